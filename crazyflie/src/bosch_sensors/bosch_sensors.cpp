@@ -54,6 +54,48 @@ static const uint8_t SENSORS_BMI088_GYRO_FS_CFG = BMI088_GYRO_RANGE_2000_DPS;
 
 static struct bmi088_dev bmi088Dev;
 
+#if defined(CONFIG_IMU_GYRO_FIFO)
+
+// Gyro FIFO registers and settings, from the BMI088 datasheet
+static const uint8_t GYRO_REG_FIFO_STATUS = 0x0E;
+static const uint8_t GYRO_REG_INT_CTRL = 0x15;
+static const uint8_t GYRO_REG_INT3_INT4_IO_CONF = 0x16;
+static const uint8_t GYRO_REG_INT3_INT4_IO_MAP = 0x18;
+static const uint8_t GYRO_REG_FIFO_WM_EN = 0x1E;
+static const uint8_t GYRO_REG_FIFO_CONFIG_0 = 0x3D;
+static const uint8_t GYRO_REG_FIFO_CONFIG_1 = 0x3E;
+static const uint8_t GYRO_REG_FIFO_DATA = 0x3F;
+
+static const uint8_t GYRO_FIFO_FRAME_COUNT_MASK = 0x7F;
+static const uint8_t GYRO_INT_FIFO_ENABLE = 0x40;
+static const uint8_t GYRO_INT3_ACTIVE_HIGH_PUSH_PULL = 0x01;
+static const uint8_t GYRO_INT3_MAP_FIFO = 0x04;
+static const uint8_t GYRO_FIFO_WM_ENABLE = 0x88;
+static const uint8_t GYRO_FIFO_STREAM_XYZ = 0x80;
+
+static bstdr_ret_t gyroWriteReg(const uint8_t reg, uint8_t value)
+{
+    return bmi088Dev.write(bmi088Dev.gyro_id, reg, &value, 1);
+}
+
+// Stream mode, interrupting on INT3 when the FIFO holds this many frames
+static bstdr_ret_t gyroFifoInit(const uint8_t watermark)
+{
+    bstdr_ret_t rslt = BSTDR_OK;
+
+    rslt |= gyroWriteReg(GYRO_REG_FIFO_CONFIG_1, GYRO_FIFO_STREAM_XYZ);
+    rslt |= gyroWriteReg(GYRO_REG_FIFO_CONFIG_0, watermark);
+    rslt |= gyroWriteReg(GYRO_REG_FIFO_WM_EN, GYRO_FIFO_WM_ENABLE);
+    rslt |= gyroWriteReg(GYRO_REG_INT3_INT4_IO_CONF,
+            GYRO_INT3_ACTIVE_HIGH_PUSH_PULL);
+    rslt |= gyroWriteReg(GYRO_REG_INT3_INT4_IO_MAP, GYRO_INT3_MAP_FIFO);
+    rslt |= gyroWriteReg(GYRO_REG_INT_CTRL, GYRO_INT_FIFO_ENABLE);
+
+    return rslt;
+}
+
+#endif
+
 bstdr_ret_t i2c_burst_read(
         uint8_t dev_id, uint8_t reg_addr, uint8_t *reg_data, uint16_t len)
 {
@@ -105,6 +147,36 @@ void ImuTask::readGyro(Axis3i16* dataOut)
     bmi088_get_gyro_data((struct bmi088_sensor_data*)dataOut, &bmi088Dev);
 }
 
+// Number of gyro samples waiting in the FIFO
+uint8_t ImuTask::readGyroFifoCount(void)
+{
+#if defined(CONFIG_IMU_GYRO_FIFO)
+    uint8_t status = 0;
+
+    bmi088Dev.read(bmi088Dev.gyro_id, GYRO_REG_FIFO_STATUS, &status, 1);
+
+    return status & GYRO_FIFO_FRAME_COUNT_MASK;
+#else
+    return 0;
+#endif
+}
+
+// Reads count gyro samples from the FIFO, oldest first, in one burst
+void ImuTask::readGyroFifo(Axis3i16 dataOut[], const uint8_t count)
+{
+#if defined(CONFIG_IMU_GYRO_FIFO)
+    // Frames are x, y, z as little-endian int16, the layout of Axis3i16,
+    // and reads of the data register don't advance the address
+    if (count > 0) {
+        bmi088Dev.read(bmi088Dev.gyro_id, GYRO_REG_FIFO_DATA,
+                (uint8_t *)dataOut, count * sizeof(Axis3i16));
+    }
+#else
+    (void)dataOut;
+    (void)count;
+#endif
+}
+
 void ImuTask::readAccel(Axis3i16* dataOut)
 {
     bmi088_get_accel_data((struct bmi088_sensor_data*)dataOut, &bmi088Dev);
@@ -132,18 +204,29 @@ void ImuTask::deviceInit(void)
 
     if (rslt == BSTDR_OK) {
 
-        struct bmi088_int_cfg intConfig;
-
         consolePrintf("IMU: BMI088 Gyro connection [OK].\n");
         
         bmi088Dev.gyro_cfg.power = BMI088_GYRO_PM_NORMAL;
         rslt |= bmi088_set_gyro_power_mode(&bmi088Dev);
         
+#if defined(CONFIG_IMU_GYRO_FIFO)
+        bmi088Dev.gyro_cfg.bw = BMI088_GYRO_BW_230_ODR_2000_HZ;
+        bmi088Dev.gyro_cfg.range = SENSORS_BMI088_GYRO_FS_CFG;
+        bmi088Dev.gyro_cfg.odr = BMI088_GYRO_BW_230_ODR_2000_HZ;
+        rslt |= bmi088_set_gyro_meas_conf(&bmi088Dev);
+
+        rslt |= gyroFifoInit(GYRO_FIFO_WATERMARK);
+
+        consolePrintf("IMU: BMI088 Gyro FIFO at %lu Hz, %d samples per read\n",
+                GYRO_RATE_HZ, GYRO_FIFO_WATERMARK);
+#else
         bmi088Dev.gyro_cfg.bw = BMI088_GYRO_BW_116_ODR_1000_HZ;
         bmi088Dev.gyro_cfg.range = SENSORS_BMI088_GYRO_FS_CFG;
         bmi088Dev.gyro_cfg.odr = BMI088_GYRO_BW_116_ODR_1000_HZ;
         rslt |= bmi088_set_gyro_meas_conf(&bmi088Dev);
 
+        struct bmi088_int_cfg intConfig;
+
         intConfig.gyro_int_channel = BMI088_INT_CHANNEL_3;
         intConfig.gyro_int_type = BMI088_GYRO_DATA_RDY_INT;
         intConfig.gyro_int_pin_3_cfg.enable_int_pin = 1;
@@ -151,6 +234,7 @@ void ImuTask::deviceInit(void)
         intConfig.gyro_int_pin_3_cfg.output_mode = 0;
         
         rslt = bmi088_set_gyro_int_config(&intConfig, &bmi088Dev);
+#endif
 
         delay(50);
         struct bmi088_sensor_data gyr;
@@ -36,9 +36,123 @@ class Clock {
         } rate_t ;
 
         static const rate_t RATE_MAIN_LOOP = RATE_1000_HZ;
+};
+
+/**
+ * Groups of work run at fixed rates from the main loop.  Group k is due on
+ * the ticks t = phase[k] (mod period[k]).  The phases are chosen at compile
+ * time, fastest group first, each putting its group on the ticks where it
+ * meets the fewest groups before it, so slower work doesn't pile onto the
+ * same tick as faster work.  At run time each group just counts down to
+ * its next tick, with no division.
+ */
+template <uint8_t N>
+class RateSchedule {
+
+    static_assert(N <= 32, "at most 32 rate groups");
+
+    public:
+
+        constexpr RateSchedule(const Clock::rate_t (&rates)[N])
+            : _period(), _phase(), _countdown()
+        {
+            for (uint8_t k=0; k<N; ++k) {
+                _period[k] = Clock::RATE_MAIN_LOOP / rates[k];
+            }
+
+            for (uint8_t k=0; k<N; ++k) {
+                _phase[k] = bestPhase(k);
+                _countdown[k] = _phase[k];
+            }
+        }
+
+        // Call once per main-loop tick; returns a mask of the groups due
+        uint32_t step(void)
+        {
+            uint32_t due = 0;
+
+            for (uint8_t k=0; k<N; ++k) {
+
+                if (_countdown[k] == 0) {
+                    due |= 1 << k;
+                    _countdown[k] = _period[k];
+                }
+
+                _countdown[k]--;
+            }
+
+            return due;
+        }
+
+        // Most groups due on any one tick
+        constexpr uint8_t maxLoad(void) const
+        {
+            uint8_t most = 0;
+
+            for (uint32_t t=0; t<hyperperiod(N); ++t) {
+                const auto load = loadAt(t, N);
+                most = load > most ? load : most;
+            }
 
-        static bool rateDoExecute(const rate_t rate, const uint32_t tick)
+            return most;
+        }
+
+        constexpr uint16_t phase(const uint8_t k) const
         {
-            return (tick % (RATE_MAIN_LOOP / rate)) == 0;
+            return _phase[k];
+        }
+
+    private:
+
+        uint16_t _period[N];
+        uint16_t _phase[N];
+        uint16_t _countdown[N];
+
+        static constexpr uint32_t gcd(const uint32_t a, const uint32_t b)
+        {
+            return b == 0 ? a : gcd(b, a % b);
+        }
+
+        // Ticks after which the first n groups repeat
+        constexpr uint32_t hyperperiod(const uint8_t n) const
+        {
+            uint32_t l = 1;
+            for (uint8_t k=0; k<n; ++k) {
+                l = l / gcd(l, _period[k]) * _period[k];
+            }
+            return l;
+        }
+
+        // How many of the first n groups are due on tick t
+        constexpr uint8_t loadAt(const uint32_t t, const uint8_t n) const
+        {
+            uint8_t load = 0;
+            for (uint8_t k=0; k<n; ++k) {
+                load += t % _period[k] == _phase[k];
+            }
+            return load;
+        }
+
+        constexpr uint16_t bestPhase(const uint8_t k) const
+        {
+            const auto ticks = hyperperiod(k + 1);
+
+            uint16_t best = 0;
+            uint32_t bestCollisions = UINT32_MAX;
+
+            for (uint16_t p=0; p<_period[k]; ++p) {
+
+                uint32_t collisions = 0;
+                for (uint32_t t=p; t<ticks; t+=_period[k]) {
+                    collisions += loadAt(t, k);
+                }
+
+                if (collisions < bestCollisions) {
+                    best = p;
+                    bestCollisions = collisions;
+                }
+            }
+
+            return best;
         }
 };
@@ -73,16 +73,40 @@ typedef struct flowMeasurement_s {
     float dt;           // Time during which pixels were accumulated
 } flowMeasurement_t;
 
+// Typed, timestamped samples passed from the sensor tasks to the estimator;
+// timestamps are in usec, when the sensor sampled the data
+
+typedef struct
+{
+  uint64_t timestamp;
+  flowMeasurement_t flow;
+} flowSample_t;
+
 typedef struct
 {
-  Axis3f gyro; // deg/s, for legacy reasons
-} gyroscopeMeasurement_t;
+  uint64_t timestamp;
+  float distance; // mm
+} rangeMeasurement_t;
 
+// Gyro and accelerometer samples of the same IMU reading
 typedef struct
 {
-  Axis3f acc; // Gs, for legacy reasons
-} accelerationMeasurement_t;
+  uint64_t timestamp;
+  Axis3f gyro; // deg/s
+  Axis3f acc;  // Gs
+} imuSample_t;
 
+// Gyro and accelerometer samples pre-integrated over a prediction interval
+typedef struct
+{
+  uint64_t timestamp;   // of the last sample integrated
+  float dt;             // sec spanned by the deltas
+  Axis3f deltaAngle;    // rad, coning-corrected rotation vector
+  Axis3f deltaVelocity; // m/s, in the body frame at the interval's start
+  Axis3f gyro;          // deg/s, the last sample
+} imuDelta_t;
+
+// Tags the samples in recorded measurement logs
 typedef enum {
     MeasurementTypeRange,
     MeasurementTypeFlow,
@@ -90,20 +114,6 @@ typedef enum {
     MeasurementTypeAcceleration,
 } MeasurementType;
 
-typedef struct {
-
-    MeasurementType type;
-
-    union {
-
-        float rangefinder_distance;
-        flowMeasurement_t flow;
-        gyroscopeMeasurement_t gyroscope;
-        accelerationMeasurement_t acceleration;
-    } data;
-
-} measurement_t;
-
 
 //////////////////////////////////////////////////////////////////////////////
 
@@ -165,4 +175,5 @@ typedef struct sensorData_s {
     Axis3f gyro;              // deg/s
     Axis3f mag;               // gauss
     uint64_t interruptTimestamp;
+    uint32_t sequence;        // counts IMU samples
 } sensorData_t;
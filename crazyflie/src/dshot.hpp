@@ -0,0 +1,80 @@
+/**
+ * DShot frame encoding for brushless ESCs
+ *
+ * Copyright (C) 2024 Simon D. Levy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * A frame is an 11-bit value, a telemetry-request bit, and a 4-bit checksum
+ * (the XOR of the three nibbles above it), sent MSB first.  Values 1-47 are
+ * ESC commands, not throttle, so a motor ratio can only give zero (stop) or
+ * 48-2047.  The frame is sent as one timer compare value per bit, fed to the
+ * timer by DMA, with a trailing zero to hold the line low afterwards.
+ */
+class Dshot {
+
+    public:
+
+        static const uint8_t FRAME_BITS = 16;
+        static const uint8_t BUFFER_SIZE = FRAME_BITS + 1;
+
+        static const uint16_t MIN_THROTTLE = 48;
+        static const uint16_t MAX_THROTTLE = 2047;
+
+        // 16-bit motor ratio to 11-bit throttle, skipping the command range
+        static constexpr uint16_t ratioToThrottle(const uint16_t ratio)
+        {
+            return (ratio >> 5) < MIN_THROTTLE ? 0 : ratio >> 5;
+        }
+
+        static constexpr uint16_t frame(
+                const uint16_t value, const bool telemetry=false)
+        {
+            return packet(((value & MAX_THROTTLE) << 1) | (telemetry ? 1 : 0));
+        }
+
+        // One compare value per bit, MSB first, then zero
+        static void expand(
+                const uint16_t frame,
+                const uint32_t oneValue,
+                const uint32_t zeroValue,
+                uint32_t buffer[BUFFER_SIZE])
+        {
+            for (uint8_t k=0; k<FRAME_BITS; ++k) {
+                buffer[k] = (frame << k) & 0x8000 ? oneValue : zeroValue;
+            }
+
+            buffer[FRAME_BITS] = 0;
+        }
+
+    private:
+
+        static constexpr uint16_t packet(const uint16_t bits)
+        {
+            return (bits << 4) | ((bits ^ (bits >> 4) ^ (bits >> 8)) & 0x0F);
+        }
+};
+
+// Checked at compile time against frames worked by hand
+static_assert(Dshot::frame(1046) == 0x82C6, "bad DShot checksum");
+static_assert(Dshot::frame(2047) == 0xFFEE, "bad DShot checksum");
+static_assert(Dshot::frame(48, true) == 0x0617, "bad DShot telemetry bit");
+static_assert(Dshot::ratioToThrottle(47 << 5) == 0, "DShot command sent");
+static_assert(Dshot::ratioToThrottle(UINT16_MAX) == Dshot::MAX_THROTTLE,
+        "bad DShot scaling");
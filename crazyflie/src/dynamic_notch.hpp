@@ -0,0 +1,376 @@
+/**
+ * Gyro notch filters tuned at runtime to the strongest vibration peak
+ *
+ * Copyright (C) 2024 Simon D. Levy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <datatypes.h>
+#include <fft.hpp>
+#include <m_pi.h>
+
+/**
+ * Gyro samples are gathered in batches of FFT_SIZE per axis.  While one
+ * batch fills, the previous one is analyzed, one axis per sample, so no
+ * sample pays for more than one FFT.  The analysis takes a Hann-windowed
+ * power spectrum and finds its NOTCHES strongest local maxima between the
+ * minimum and maximum frequencies -- a motor's vibration and its harmonic,
+ * or two motors spinning apart -- and compares each with the noise floor:
+ * the mean power of the band away from those peaks.
+ *
+ * Each axis has a bank of NOTCHES notches in series, each following one
+ * peak.  A noise spike can stand out in one batch, but not at the same
+ * frequency batch after batch as a motor's vibration does, so a notch
+ * engages only after its peak has held its bin for ENGAGE_FRAMES batches.
+ * It then moves part of the way toward the peak, refined with the bins on
+ * either side, on every batch that has one, and returns to pass-through
+ * after RELEASE_FRAMES batches without.
+ *
+ * The notches are direct-form I biquads, which keep their past inputs and
+ * outputs rather than internal states, so retuning one doesn't make its
+ * output jump.
+ */
+class DynamicNotch {
+
+    public:
+
+        static const uint16_t FFT_SIZE = 64;
+
+        // Notches per axis
+        static const uint8_t NOTCHES = 2;
+
+        // Shared with logger: notch centers in Hz, zero while passing through
+        float centerHz[3][NOTCHES];
+
+        void init(
+                const float sampleRateHz,
+                const float minHz,
+                const float maxHz,
+                const float q)
+        {
+            memset(this, 0, sizeof(*this));
+
+            _sampleRateHz = sampleRateHz;
+            _q = q;
+
+            const float binHz = sampleRateHz / FFT_SIZE;
+
+            _minBin = (uint16_t)ceilf(minHz / binHz);
+            _maxBin = (uint16_t)(maxHz / binHz);
+
+            // Room for a neighbor on either side of the peak
+            _minBin = _minBin < 1 ? 1 : _minBin;
+            _maxBin = _maxBin > FFT_SIZE/2 - 2 ? FFT_SIZE/2 - 2 : _maxBin;
+
+            _binHz = binHz;
+            _minHz = minHz;
+            _maxHz = maxHz;
+
+            for (uint16_t k=0; k<FFT_SIZE; ++k) {
+                _window[k] = 0.5f * (1 - cosf(2 * (float)M_PI * k / FFT_SIZE));
+            }
+
+            // Pass-through until a peak is found
+            for (uint8_t i=0; i<3; ++i) {
+                for (uint8_t n=0; n<NOTCHES; ++n) {
+                    bypass(_notches[i][n]);
+                }
+            }
+
+            _analyzeAxis = 3;
+
+            _fft.init();
+        }
+
+        // Filters one sample of all three axes, in deg/sec
+        void apply(Axis3f & gyro)
+        {
+            collect(gyro);
+
+            if (_analyzeAxis < 3) {
+                analyze(_analyzeAxis);
+                _analyzeAxis++;
+            }
+
+            for (uint8_t i=0; i<3; ++i) {
+                for (uint8_t n=0; n<NOTCHES; ++n) {
+                    gyro.axis[i] = filter(_notches[i][n], gyro.axis[i]);
+                }
+            }
+        }
+
+    private:
+
+        // A peak must have this many times the power of the noise floor
+        static constexpr float PEAK_RATIO = 12;
+
+        // Batches a peak must hold its bin (give or take one) for its notch
+        // to engage, and batches without it for the notch to release
+        static const uint8_t ENGAGE_FRAMES = 4;
+        static const uint8_t RELEASE_FRAMES = 8;
+
+        // How far a notch moves toward each new peak
+        static constexpr float SMOOTHING = 0.3f;
+
+        typedef struct {
+            float b0, b1, b2, a1, a2;
+            float x1, x2, y1, y2;
+        } notch_t;
+
+        RealFft<FFT_SIZE> _fft;
+
+        float _window[FFT_SIZE];
+
+        // Working space for the analysis, kept off the IMU task's stack
+        float _windowed[FFT_SIZE];
+        float _power[FFT_SIZE/2];
+
+        // One batch fills while the other is analyzed
+        float _batches[2][3][FFT_SIZE];
+        uint8_t _filling;
+        uint16_t _count;
+        uint8_t _analyzeAxis;
+
+        notch_t _notches[3][NOTCHES];
+
+        typedef struct {
+            uint16_t bin;   // of the last peak found
+            uint8_t hits;   // batches in a row with a peak near that bin
+            uint8_t misses; // batches in a row without a peak
+        } track_t;
+
+        track_t _tracks[3][NOTCHES];
+
+        float _sampleRateHz;
+        float _q;
+        float _binHz;
+        float _minHz;
+        float _maxHz;
+        uint16_t _minBin;
+        uint16_t _maxBin;
+
+        void collect(const Axis3f & gyro)
+        {
+            for (uint8_t i=0; i<3; ++i) {
+                _batches[_filling][i][_count] = gyro.axis[i];
+            }
+
+            if (++_count == FFT_SIZE) {
+                _count = 0;
+                _filling ^= 1;
+                _analyzeAxis = 0;
+            }
+        }
+
+        void analyze(const uint8_t axis)
+        {
+            const float * samples = _batches[_filling ^ 1][axis];
+
+            auto windowed = _windowed;
+            auto power = _power;
+
+            for (uint16_t k=0; k<FFT_SIZE; ++k) {
+                windowed[k] = samples[k] * _window[k];
+            }
+
+            _fft.powerSpectrum(windowed, power);
+
+            // The strongest local maxima of the band, strongest first
+            uint16_t peaks[NOTCHES] = {};
+            uint8_t count = 0;
+
+            for (uint16_t k=_minBin; k<=_maxBin; ++k) {
+
+                if (power[k] <= power[k-1] || power[k] < power[k+1]) {
+                    continue;
+                }
+
+                uint8_t j = count < NOTCHES ? count++ : NOTCHES;
+
+                for (; j > 0 && power[peaks[j-1]] < power[k]; --j) {
+                    if (j < NOTCHES) {
+                        peaks[j] = peaks[j-1];
+                    }
+                }
+
+                if (j < NOTCHES) {
+                    peaks[j] = k;
+                }
+            }
+
+            float noise = 0;
+            uint16_t floorBins = 0;
+
+            for (uint16_t k=_minBin; k<=_maxBin; ++k) {
+
+                auto isNearPeak = false;
+                for (uint8_t p=0; p<count; ++p) {
+                    isNearPeak |= isNear(k, peaks[p]);
+                }
+
+                if (!isNearPeak) {
+                    noise += power[k];
+                    floorBins++;
+                }
+            }
+
+            noise = floorBins > 0 ? noise / floorBins : 0;
+
+            // Being sorted, the peaks that stand out come first
+            uint8_t qualified = 0;
+            while (qualified < count &&
+                    power[peaks[qualified]] > PEAK_RATIO * noise) {
+                qualified++;
+            }
+
+            auto tracks = _tracks[axis];
+            auto centers = centerHz[axis];
+
+            // Index of the peak each notch follows this batch, if any
+            int8_t match[NOTCHES];
+            for (uint8_t n=0; n<NOTCHES; ++n) {
+                match[n] = -1;
+            }
+
+            bool isClaimed[NOTCHES] = {};
+
+            // First give each notch that is following a peak, or engaged on
+            // one, the peak still near it ...
+            for (uint8_t n=0; n<NOTCHES; ++n) {
+
+                if (tracks[n].hits == 0 && centers[n] == 0) {
+                    continue;
+                }
+
+                for (uint8_t p=0; p<qualified; ++p) {
+                    if (!isClaimed[p] && isNear(peaks[p], tracks[n].bin)) {
+                        match[n] = p;
+                        isClaimed[p] = true;
+                        tracks[n].hits = tracks[n].hits < ENGAGE_FRAMES ?
+                            tracks[n].hits + 1 : tracks[n].hits;
+                        break;
+                    }
+                }
+            }
+
+            // ... then start the notches that are free on the other peaks
+            for (uint8_t p=0; p<qualified; ++p) {
+
+                for (uint8_t n=0; !isClaimed[p] && n<NOTCHES; ++n) {
+                    if (match[n] < 0 && centers[n] == 0) {
+                        match[n] = p;
+                        isClaimed[p] = true;
+                        tracks[n].hits = 1;
+                    }
+                }
+            }
+
+            for (uint8_t n=0; n<NOTCHES; ++n) {
+                track(axis, n, match[n] < 0 ? 0 : peaks[match[n]]);
+            }
+        }
+
+        // Steps one notch's hysteresis; bin is zero if it has no peak
+        void track(const uint8_t axis, const uint8_t n, const uint16_t bin)
+        {
+            auto & track = _tracks[axis][n];
+            auto & center = centerHz[axis][n];
+
+            if (bin == 0) {
+
+                track.hits = 0;
+
+                if (track.misses < RELEASE_FRAMES) {
+                    track.misses++;
+                }
+
+                if (track.misses == RELEASE_FRAMES && center != 0) {
+                    center = 0;
+                    bypass(_notches[axis][n]);
+                }
+
+                return;
+            }
+
+            track.bin = bin;
+            track.misses = 0;
+
+            if (track.hits < ENGAGE_FRAMES && center == 0) {
+                return;
+            }
+
+            // Centroid of the peak and its neighbors
+            const auto power = _power;
+            const float left = power[bin - 1];
+            const float right = power[bin + 1];
+            const float offset =
+                (right - left) / (left + power[bin] + right);
+
+            float hz = (bin + offset) * _binHz;
+
+            hz = hz < _minHz ? _minHz : hz > _maxHz ? _maxHz : hz;
+
+            center = center == 0 ? hz : center + SMOOTHING * (hz - center);
+
+            tune(_notches[axis][n], center);
+        }
+
+        static bool isNear(const uint16_t a, const uint16_t b)
+        {
+            return a + 1 >= b && a <= b + 1;
+        }
+
+        static void bypass(notch_t & notch)
+        {
+            notch.b0 = 1;
+            notch.b1 = 0;
+            notch.b2 = 0;
+            notch.a1 = 0;
+            notch.a2 = 0;
+        }
+
+        void tune(notch_t & notch, const float hz) const
+        {
+            const float omega = 2 * (float)M_PI * hz / _sampleRateHz;
+            const float cosw = cosf(omega);
+            const float alpha = sinf(omega) / (2 * _q);
+            const float a0 = 1 + alpha;
+
+            notch.b0 = 1 / a0;
+            notch.b1 = -2 * cosw / a0;
+            notch.b2 = 1 / a0;
+            notch.a1 = -2 * cosw / a0;
+            notch.a2 = (1 - alpha) / a0;
+        }
+
+        static float filter(notch_t & notch, const float x)
+        {
+            const float y =
+                notch.b0 * x + notch.b1 * notch.x1 + notch.b2 * notch.x2 -
+                notch.a1 * notch.y1 - notch.a2 * notch.y2;
+
+            notch.x2 = notch.x1;
+            notch.x1 = x;
+            notch.y2 = notch.y1;
+            notch.y1 = y;
+
+            return y;
+        }
+};
@@ -16,11 +16,8 @@
 
 #include <string.h>
 
-#define EKF_CUSTOM
-#define EKF_M 3 // range, flowx, flowy
-#define EKF_N 7 // z, dx, dy, dz, e0, e1, e2
-#include <tinyekf.h>
-#include <tinyekf_custom.h>
+#include <ekf_packed.hpp>
+#include <ekf_ud.hpp>
 
 #if defined(ARDUINO)
 #include <hackflight.hpp>
@@ -36,81 +33,815 @@ namespace hf {
 int consolePrintf(const char * fmt, ...);
 #endif
 
-class EKF {
+/**
+ * The filter is templated on its core, which holds the state and covariance
+ * and does the linear algebra: PackedEkf (packed-symmetric covariance, with
+ * clamping after each step) or UdEkf (UD-factorized covariance, which needs
+ * none).
+ */
+template <template <uint8_t, uint8_t> class Core>
+class BasicEKF {
+
+    public:
+
+        static const uint8_t N = 7; // z, dx, dy, dz, e0, e1, e2
+        static const uint8_t M = 3; // range, flowx, flowy
+
+        /**
+          * With imuRateMean, the state mean and quaternion are propagated
+          * on every IMU sample, and predict() propagates only the
+          * covariance, through the Jacobian accumulated since the last
+          * call.
+          */
+        void initialize(const bool imuRateMean=false)
+        {
+            const float pdiag[N] = {
+                square(STDEV_INITIAL_POSITION_Z),
+                square(STDEV_INITIAL_VELOCITY),
+                square(STDEV_INITIAL_VELOCITY),
+                square(STDEV_INITIAL_VELOCITY),
+                square(STDEV_INITIAL_ATTITUDE_ROLL_PITCH),
+                square(STDEV_INITIAL_ATTITUDE_ROLL_PITCH),
+                square(STDEV_INITIAL_ATTITUDE_YAW)
+            };
+
+            _isUpdated = false;
+
+            _historyCount = 0;
+
+            _lastProcessNoiseUpdateUsec = 0;
+
+            _imuRateMean = imuRateMean;
+            _meanUsec = 0;
+            _meanSteps = 0;
+
+            _ekf.initialize(pdiag);
+
+            _quat.w = QW_INIT;
+            _quat.x = QX_INIT;
+            _quat.y = QY_INIT;
+            _quat.z = QZ_INIT;
+
+            _r.x = 0;
+            _r.y = 0;
+            _r.z = 0;
+
+            updateEuler();
+        }
+
+        void accumulate_gyro(const uint64_t timestampUsec, const axis3_t & gyro) 
+        {
+            imuAccum(gyro, _gyroSum);
+
+            memcpy(&_gyroLatest, &gyro, sizeof(axis3_t));
+
+            _imuTimestampUsec = timestampUsec;
+        }
+
+        void accumulate_accel(const uint64_t timestampUsec, const axis3_t & accel) 
+        {
+            imuAccum(accel, _accelSum);
+
+            // The gyro sample of the same IMU reading arrives first
+            if (_imuRateMean) {
+
+                const float dt = (timestampUsec - _meanUsec) / 1e6f;
+
+                if (_meanUsec > 0 && dt > 0 && dt < MAX_MEAN_STEP) {
+                    stepMean(dt, accel);
+                }
+
+                _meanUsec = timestampUsec;
+            }
+        }
+
+        /**
+          * Takes the place of the two functions above when the IMU samples
+          * have been pre-integrated over the coming prediction interval;
+          * the deltas stand in for the mean rate and acceleration.  Not for
+          * use with the IMU-rate mean.
+          */
+        void accumulate_delta(const imuDelta_t & delta)
+        {
+            if (delta.dt <= 0) {
+                return;
+            }
+
+            const auto gyroScale = 1 / (delta.dt * DEGREES_TO_RADIANS);
+
+            const axis3_t gyro = {
+                delta.deltaAngle.x * gyroScale,
+                delta.deltaAngle.y * gyroScale,
+                delta.deltaAngle.z * gyroScale
+            };
+
+            const auto accelScale = 1 / (delta.dt * GS_TO_MSS);
+
+            const axis3_t accel = {
+                delta.deltaVelocity.x * accelScale,
+                delta.deltaVelocity.y * accelScale,
+                delta.deltaVelocity.z * accelScale
+            };
+
+            imuAccum(gyro, _gyroSum);
+            imuAccum(accel, _accelSum);
+
+            memcpy(&_gyroLatest, &delta.gyro, sizeof(axis3_t));
+
+            _imuTimestampUsec = delta.timestamp;
+        }
+
+        void predict(void)
+        {
+            // Compute DT from the sensor timestamps of the IMU samples
+            // accumulated since the last prediction, rather than from the
+            // (1 msec) task clock
+            const auto nowUsec = _imuTimestampUsec;
+            const float dt = (nowUsec - _predictionUsec) / 1e6f;
+            _predictionUsec = nowUsec;
+
+            imuTakeMean(_gyroSum, DEGREES_TO_RADIANS, _gyroMean);
+            imuTakeMean(_accelSum, GS_TO_MSS, _accelMean);
+
+            // The mean is already current; the means of the interval are
+            // kept only for replaying it from the history
+            if (_imuRateMean) {
+
+                memset(&_gyroSum, 0, sizeof(_gyroSum));
+                memset(&_accelSum, 0, sizeof(_accelSum));
+
+                const auto meanSteps = _meanSteps;
+
+                if (_meanSteps > 0) {
+                    propagateCovariance(_jacobian);
+                    cleanupCovariance();
+                    _meanSteps = 0;
+                }
+
+                pushEpoch(nowUsec, dt, true, meanSteps);
+
+                return;
+            }
+
+            // Avoid multiple updates within 1 msec of each other
+            const auto shouldUpdateMean =
+                nowUsec - _lastProcessNoiseUpdateUsec >= 1000;
+
+            if (shouldUpdateMean) {
+
+                _lastProcessNoiseUpdateUsec = nowUsec;
+
+                memset(&_gyroSum, 0, sizeof(_gyroSum));
+                memset(&_accelSum, 0, sizeof(_accelSum));
+            }
+
+            propagate(_gyroMean, _accelMean, dt, shouldUpdateMean);
+
+            pushEpoch(nowUsec, dt, shouldUpdateMean, 0);
+        }
+
+        /**
+          * Range and flow measurements are time-stamped with the sensor
+          * time (usec) at which they were taken.  Ones that arrive after
+          * the filter has predicted past that time are fused at the epoch
+          * they belong to, and the state is then re-propagated to the
+          * present.
+          */
+        void update_with_range(
+                const float distance, const uint64_t timestampUsec)
+        {
+            logged_measurement_t m = {};
+            m.isFlow = false;
+            m.range = distance;
+
+            fuse(m, timestampUsec);
+        }
+
+        void update_with_flow(
+                const float dt,
+                const float dx,
+                const float dy,
+                const uint64_t timestampUsec)
+        {
+            logged_measurement_t m = {};
+            m.isFlow = true;
+            m.flowDt = dt;
+            m.flowDx = dx;
+            m.flowDy = dy;
+            m.omegaX = _gyroLatest.x * DEGREES_TO_RADIANS;
+            m.omegaY = _gyroLatest.y * DEGREES_TO_RADIANS;
+
+            fuse(m, timestampUsec);
+        }
+
+        /**
+          * Returns false if state is OOB, true otherwise
+          */
+        bool finalize(void)
+        {
+            const auto x = _ekf.x;
+
+            incorporateAttitudeError();
+
+            return
+                isPositionWithinBounds(x[STATE_Z]) &&
+                isVelocityWithinBounds(x[STATE_DX]) &&
+                isVelocityWithinBounds(x[STATE_DY]) &&
+                isVelocityWithinBounds(x[STATE_DZ]);
+        }
+
+        void get_vehicle_state(vehicleState_t & state)
+        {
+            const auto x = _ekf.x;
+
+            state.dx = x[STATE_DX];
+
+            state.dy = x[STATE_DY];
+
+            state.z = x[STATE_Z];
+
+            state.z = min(0, state.z);
+
+            state.dz = _r.x * x[STATE_DX] + _r.y * x[STATE_DY] + 
+                _r.z * x[STATE_DZ];
+
+            // Pack Z and DZ into a single float for transmission to client
+#if !defined(ARDUINO)
+            const int8_t sgn = state.dz < 0 ? -1 : +1;
+            const float s = 1000;
+            state.z_dz = (int)(state.dz * s) + sgn * state.z / s;
+#endif
+
+            // The quaternion changes only on a prediction or an update, so
+            // most calls can reuse the Euler angles from the last one
+            if (memcmp(&_quat, &_eulerQuat, sizeof(new_quat_t)) != 0) {
+                updateEuler();
+            }
+
+            state.phi = _phi;
+            state.theta = _theta;
+            state.psi = _psi;
+
+            // Get angular velocities directly from gyro
+            state.dphi =    _gyroLatest.x;
+            state.dtheta = -_gyroLatest.y; // negate for ENU
+            state.dpsi =    _gyroLatest.z;
+
+        }
+
+        float get_covariance(const uint8_t i, const uint8_t j) const
+        {
+            return _ekf.get(i, j);
+        }
+
+        /**
+          * For consumers that can work with the attitude quaternion
+          * directly, avoiding the conversion to Euler angles
+          */
+        void get_quaternion(
+                float & qw, float & qx, float & qy, float & qz) const
+        {
+            qw = _quat.w;
+            qx = _quat.x;
+            qy = _quat.y;
+            qz = _quat.z;
+        }
+
+    private:
+
+        // Initial variances, uncertain of position, but know we're
+        // stationary and roughly flat
+        static constexpr float STDEV_INITIAL_POSITION_Z = 1;
+        static constexpr float STDEV_INITIAL_VELOCITY = 0.01;
+        static constexpr float STDEV_INITIAL_ATTITUDE_ROLL_PITCH = 0.01;
+        static constexpr float STDEV_INITIAL_ATTITUDE_YAW = 0.01;
+
+        // The bounds on the covariance, applied by the packed core.  The
+        // transition and attitude-reset Jacobians both have a zero first
+        // column, so the altitude variance keeps collapsing towards zero
+        // and the lower bound is hit on most steps; the UD core carries
+        // it exactly instead.
+        static constexpr float MAX_COVARIANCE = 100;
+        static constexpr float MIN_COVARIANCE = 1e-6;
+
+        // Quaternion used for initial orientation
+        static constexpr float QW_INIT = 1;
+        static constexpr float QX_INIT = 0;
+        static constexpr float QY_INIT = 0;
+        static constexpr float QZ_INIT = 0;
+
+        // ~~~ Camera constexprants ~~~
+        // The angle of aperture is guessed from the raw data register and
+        // thankfully look to be symmetric
+
+        static constexpr float FLOW_NPIX = 35.0;   // [pixels] (same in x and y)
+
+        // 2*sin(42/2); 42degree is the agnle of aperture, here we computed the
+        // corresponding ground length
+        static constexpr float FLOW_THETAPIX = 0.71674;
+
+        static constexpr float GS_TO_MSS = 9.81;
+
+        //We do get the measurements in 10x the motion pixels (experimentally
+        //measured)
+        static constexpr float FLOW_RESOLUTION = 0.1;
+
+        // The bounds on states, these shouldn't be hit...
+        static constexpr float MAX_POSITION = 100; //meters
+        static constexpr float MAX_VELOCITY = 10; //meters per second
+
+        // Small number epsilon, to prevent dividing by zero
+        static constexpr float EPS = 1e-6f;
+
+        // the reversion of pitch and roll to zero, per prediction at the
+        // nominal 100 Hz rate
+        static constexpr float ROLLPITCH_ZERO_REVERSION = 0.001;
+        static constexpr float NOMINAL_PREDICTION_DT = 0.01;
+
+        // IMU-rate mode: longer gaps between samples are not integrated
+        static constexpr float MAX_MEAN_STEP = 0.1;
+
+        static constexpr uint16_t RANGEFINDER_OUTLIER_LIMIT_MM = 5000;
+
+        // Rangefinder measurement noise model
+        static constexpr float RANGEFINDER_EXP_POINT_A = 2.5;
+        static constexpr float RANGEFINDER_EXP_STD_A = 0.0025; 
+        static constexpr float RANGEFINDER_EXP_POINT_B = 4.0;
+        static constexpr float RANGEFINDER_EXP_STD_B = 0.2;   
+
+        static constexpr float RANGEFINDER_EXP_COEFF = 
+            logf( RANGEFINDER_EXP_STD_B / RANGEFINDER_EXP_STD_A) / 
+            (RANGEFINDER_EXP_POINT_B - RANGEFINDER_EXP_POINT_A);
+
+        static constexpr float FLOW_STD_FIXED = 2.0;
+
+        // Prediction epochs kept for fusing delayed measurements; at the
+        // 100 Hz prediction rate this spans the 25 msec ranging budget
+        static const uint8_t HISTORY_LENGTH = 4;
+
+        // Range at 40 Hz and flow at 100 Hz give at most two per epoch
+        static const uint8_t MAX_EPOCH_MEASUREMENTS = 3;
+
+        typedef Core<N, M> ekf_t;
+
+        ekf_t _ekf;
+
+        void update_with_scalar(
+                const float z,
+                const float hx,
+                const float h[N], 
+                const float r)
+        {
+            _ekf.scalar_update(z, hx, h, r);
+
+            cleanupCovariance();
+
+            _isUpdated = true;
+        }
+
+        typedef struct {
+
+            float w;
+            float x;
+            float y;
+            float z;
+
+        } new_quat_t;
+
+        typedef struct {
+
+            axis3_t sum;
+            uint32_t count;
+
+        } imu_t;
+
+        // Measurement fused at some epoch, kept so that the epoch can be
+        // re-fused when an older measurement arrives
+        typedef struct {
+
+            bool isFlow;
+
+            float range;  // mm
+
+            float flowDt;
+            float flowDx;
+            float flowDy;
+            float omegaX; // rad/sec, body rates when the flow was taken
+            float omegaY;
+
+        } logged_measurement_t;
+
+        typedef struct {
+
+            ekf_t ekf;
+            new_quat_t quat;
+
+        } snapshot_t;
+
+        // Jacobian of the state-transition function, in blocks:
+        //
+        //       | 0  zrow       |
+        //   F = | 0  VV  VE     |
+        //       | 0  0   EE     |
+        //
+        // The first column and lower-left block are zero, so we keep only
+        // the nonzero blocks and propagate them sparsely.  A product of
+        // such matrices has the same form, so the Jacobians of several
+        // steps can be accumulated into one.
+        typedef struct {
+
+            float zrow[6];
+            float VV[3][3];
+            float VE[3][3];
+            float EE[3][3];
+
+        } jacobian_t;
+
+        // One prediction epoch: the inputs that propagated the state to it,
+        // the prior state just after that, and the measurements fused before
+        // the next prediction.  In IMU-rate mode, also the number of mean
+        // steps taken and the Jacobian accumulated over them.
+        typedef struct {
+
+            uint64_t timestampUsec;
+
+            axis3_t gyro;
+            axis3_t accel;
+            float dt;
+            bool shouldUpdateMean;
+
+            uint16_t meanSteps;
+            jacobian_t jacobian;
+
+            snapshot_t prior;
+
+            logged_measurement_t measurements[MAX_EPOCH_MEASUREMENTS];
+            uint8_t measurementCount;
+
+        } epoch_t;
+
+        epoch_t _history[HISTORY_LENGTH];
+        uint8_t _historyNewest;
+        uint8_t _historyCount;
+
+        void saveSnapshot(snapshot_t & snapshot)
+        {
+            memcpy(&snapshot.ekf, &_ekf, sizeof(ekf_t));
+            memcpy(&snapshot.quat, &_quat, sizeof(new_quat_t));
+        }
+
+        void restoreSnapshot(const snapshot_t & snapshot)
+        {
+            memcpy(&_ekf, &snapshot.ekf, sizeof(ekf_t));
+            memcpy(&_quat, &snapshot.quat, sizeof(new_quat_t));
+        }
+
+        void pushEpoch(
+                const uint64_t timestampUsec,
+                const float dt,
+                const bool shouldUpdateMean,
+                const uint16_t meanSteps)
+        {
+            _historyNewest = (_historyNewest + 1) % HISTORY_LENGTH;
+
+            if (_historyCount < HISTORY_LENGTH) {
+                _historyCount++;
+            }
+
+            auto & epoch = _history[_historyNewest];
+
+            epoch.timestampUsec = timestampUsec;
+            epoch.gyro = _gyroMean;
+            epoch.accel = _accelMean;
+            epoch.dt = dt;
+            epoch.shouldUpdateMean = shouldUpdateMean;
+            epoch.meanSteps = meanSteps;
+            epoch.measurementCount = 0;
+
+            if (meanSteps > 0) {
+                epoch.jacobian = _jacobian;
+            }
+
+            saveSnapshot(epoch.prior);
+        }
+
+        static bool logMeasurement(
+                epoch_t & epoch, const logged_measurement_t & m)
+        {
+            if (epoch.measurementCount == MAX_EPOCH_MEASUREMENTS) {
+                return false;
+            }
+
+            epoch.measurements[epoch.measurementCount++] = m;
+
+            return true;
+        }
+
+        void applyMeasurement(const logged_measurement_t & m)
+        {
+            if (m.isFlow) {
+                fuseFlow(m);
+            }
+            else {
+                fuseRange(m.range);
+            }
+        }
+
+        void fuse(const logged_measurement_t & m, const uint64_t timestampUsec)
+        {
+            // Find the newest epoch at or before the measurement, settling
+            // for the oldest one we have if it is older than the history.
+            // One less than a prediction period old is fused into the
+            // present state: replaying a whole period to place it a
+            // fraction of one earlier is not worth the cost, and flow,
+            // stamped mid-interval, would otherwise always be replayed.
+            uint8_t age = 0;
+            if (_historyCount > 0 && !isWithinPeriod(timestampUsec)) {
+                while (age + 1 < _historyCount &&
+                        _history[historyIndex(age)].timestampUsec >
+                        timestampUsec) {
+                    age++;
+                }
+            }
+
+            logged_measurement_t delayed = m;
+
+            // Flow needs the body rates at the time it was taken
+            if (age > 0 && m.isFlow) {
+                const auto & gyro = _history[historyIndex(age)].gyro;
+                delayed.omegaX = gyro.x;
+                delayed.omegaY = gyro.y;
+            }
+
+            // Current epoch (or a full one): fuse into the present state,
+            // logging it so that a later retrodiction will replay it
+            if (age == 0 || !logMeasurement(_history[historyIndex(age)], delayed)) {
+
+                applyMeasurement(m);
+
+                if (_historyCount > 0) {
+                    logMeasurement(_history[_historyNewest], m);
+                }
+
+                return;
+            }
+
+            // Retrodiction: restore the prior at that epoch, re-fuse its
+            // measurements (now including this one), then replay the
+            // predictions and updates of each newer epoch.  Bounded by
+            // HISTORY_LENGTH propagations.
+            restoreSnapshot(_history[historyIndex(age)].prior);
+
+            for (int8_t k=age; k>=0; --k) {
+
+                auto & epoch = _history[historyIndex(k)];
+
+                if (k < age) {
+                    repropagate(epoch);
+                    saveSnapshot(epoch.prior);
+                }
+
+                // As the finalize on every estimator tick does
+                updateRotation();
+
+                for (uint8_t i=0; i<epoch.measurementCount; ++i) {
+                    applyMeasurement(epoch.measurements[i]);
+                }
+
+                // The newest epoch is finalized by the caller as usual
+                if (k > 0) {
+                    incorporateAttitudeError();
+                }
+            }
+
+            // In IMU-rate mode the mean had moved past the newest epoch;
+            // bring it back up to date with the samples since then.  The
+            // accumulated Jacobian already covers them.
+            if (_imuRateMean && _meanUsec > _predictionUsec) {
+
+                axis3_t gyro = {};
+                axis3_t accel = {};
+                imuTakeMean(_gyroSum, DEGREES_TO_RADIANS, gyro);
+                imuTakeMean(_accelSum, GS_TO_MSS, accel);
+
+                jacobian_t F = {};
+                advanceMean(gyro, accel,
+                        (_meanUsec - _predictionUsec) / 1e6f, F);
+            }
+        }
+
+        bool isWithinPeriod(const uint64_t timestampUsec) const
+        {
+            const auto & newest = _history[_historyNewest];
+
+            return timestampUsec + (uint64_t)(newest.dt * 1e6f) >
+                newest.timestampUsec;
+        }
+
+        /**
+          * Propagates the state to an epoch as predict() did.  In IMU-rate
+          * mode that is the same number of mean steps, taken on the epoch's
+          * mean readings since the samples themselves are not kept, and
+          * the covariance through the Jacobian accumulated over the
+          * original steps.
+          */
+        void repropagate(const epoch_t & epoch)
+        {
+            if (epoch.meanSteps == 0) {
+                propagate(epoch.gyro, epoch.accel, epoch.dt,
+                        epoch.shouldUpdateMean);
+                return;
+            }
+
+            const auto dt = epoch.dt / epoch.meanSteps;
+
+            jacobian_t F = {};
+            for (uint16_t i=0; i<epoch.meanSteps; ++i) {
+                advanceMean(epoch.gyro, epoch.accel, dt, F);
+            }
+
+            propagateCovariance(epoch.jacobian);
+
+            cleanupCovariance();
+        }
+
+        uint8_t historyIndex(const uint8_t age) const
+        {
+            return (_historyNewest + HISTORY_LENGTH - age) % HISTORY_LENGTH;
+        }
+
+        axis3_t _gyroLatest;
+
+        // Mean IMU readings of the latest prediction interval
+        axis3_t _gyroMean;
+        axis3_t _accelMean;
+
+        new_quat_t _quat;
+
+        // Euler angles (degrees) for the quaternion they were computed from
+        new_quat_t _eulerQuat;
+        float _phi;
+        float _theta;
+        float _psi;
 
-    public:
+        bool _isUpdated;
 
-        void initialize(void)
-        {
-            const float pdiag[EKF_N] = {
-                square(STDEV_INITIAL_POSITION_Z),
-                square(STDEV_INITIAL_VELOCITY),
-                square(STDEV_INITIAL_VELOCITY),
-                square(STDEV_INITIAL_VELOCITY),
-                square(STDEV_INITIAL_ATTITUDE_ROLL_PITCH),
-                square(STDEV_INITIAL_ATTITUDE_ROLL_PITCH),
-                square(STDEV_INITIAL_ATTITUDE_YAW)
-            };
+        // Sensor time (usec) of the newest IMU sample, and of the state
+        uint64_t _imuTimestampUsec;
+        uint64_t _predictionUsec;
 
-            _isUpdated = false;
+        // Sensor time (usec) the IMU sums were last folded into the mean
+        uint64_t _lastProcessNoiseUpdateUsec;
 
-            ekf_initialize(&_ekf, pdiag);
+        uint32_t _nextPredictionMsec;
 
-            _quat.w = QW_INIT;
-            _quat.x = QX_INIT;
-            _quat.y = QY_INIT;
-            _quat.z = QZ_INIT;
+        axis3_t _r;
 
-            _r.x = 0;
-            _r.y = 0;
-            _r.z = 0;
-        }
+        imu_t _gyroSum;
+        imu_t _accelSum;
+
+        // Indexes to access the state
+        enum {
+
+            STATE_Z,
+            STATE_DX,
+            STATE_DY,
+            STATE_DZ,
+            STATE_E0,
+            STATE_E1,
+            STATE_E2
+        };
 
-        void accumulate_gyro(const uint32_t nowMsec, const axis3_t & gyro) 
+        // IMU-rate mode: sensor time (usec) of the mean, and the Jacobian
+        // accumulated over the mean steps since the last covariance
+        // propagation
+        bool _imuRateMean;
+        uint64_t _meanUsec;
+        jacobian_t _jacobian;
+        uint16_t _meanSteps;
+
+        /**
+          * Propagates the state and covariance by dt using the mean gyro
+          * (rad/sec) and accelerometer (m/sec^2) readings.  Depends only on
+          * its arguments and the filter state, so it can be replayed from
+          * the state history.
+          */
+        void propagate(
+                const axis3_t & gyro,
+                const axis3_t & accel,
+                const float dt,
+                const bool shouldUpdateMean)
         {
-            imuAccum(gyro, _gyroSum);
+            float xnew[STATE_E0] = {};
+            new_quat_t quat_predicted = {};
+            jacobian_t F = {};
 
-            memcpy(&_gyroLatest, &gyro, sizeof(axis3_t));
+            predictMean(gyro, accel, dt, ROLLPITCH_ZERO_REVERSION,
+                    xnew, quat_predicted, F);
+
+            if (shouldUpdateMean) {
+
+                for (uint8_t i=0; i<STATE_E0; ++i) {
+                    _ekf.x[i] = xnew[i];
+                }
+
+                _quat = quat_predicted;
+            }
+
+            // We'll add process noise after final update
+            propagateCovariance(F);
 
+            cleanupCovariance();
         }
 
-        void accumulate_accel(const uint32_t nowMsec, const axis3_t & accel) 
+        /**
+          * Strap-down integration of one IMU sample into the state mean and
+          * quaternion, for the IMU-rate mode.  The step's Jacobian is
+          * folded into the one accumulated since the last covariance
+          * propagation.
+          */
+        void stepMean(const float dt, const axis3_t & accel)
         {
-            imuAccum(accel, _accelSum);
+            const axis3_t gyro = {
+                _gyroLatest.x * DEGREES_TO_RADIANS,
+                _gyroLatest.y * DEGREES_TO_RADIANS,
+                _gyroLatest.z * DEGREES_TO_RADIANS
+            };
+
+            const axis3_t accelMss = {
+                accel.x * GS_TO_MSS,
+                accel.y * GS_TO_MSS,
+                accel.z * GS_TO_MSS
+            };
+
+            jacobian_t F = {};
+
+            advanceMean(gyro, accelMss, dt, F);
+
+            if (_meanSteps == 0) {
+                _jacobian = F;
+            }
+            else {
+                accumulateJacobian(F, _jacobian);
+            }
+
+            _meanSteps++;
         }
 
-        void predict(const uint32_t nowMsec)
+        void advanceMean(
+                const axis3_t & gyro,
+                const axis3_t & accel,
+                const float dt,
+                jacobian_t & F)
         {
-            // Compute DT
-            static uint32_t _lastPredictionMsec;
-            const float dt = (nowMsec - _lastPredictionMsec) / 1000.0f;
-            _lastPredictionMsec = nowMsec;
+            float xnew[STATE_E0] = {};
 
-            static axis3_t _gyro;
-            static axis3_t _accel;
+            // Scale the reversion so that its time constant does not
+            // depend on the step size
+            predictMean(gyro, accel, dt,
+                    ROLLPITCH_ZERO_REVERSION * dt / NOMINAL_PREDICTION_DT,
+                    xnew, _quat, F);
 
-            const auto dt2 = dt * dt;
+            for (uint8_t i=0; i<STATE_E0; ++i) {
+                _ekf.x[i] = xnew[i];
+            }
 
-            imuTakeMean(_gyroSum, DEGREES_TO_RADIANS, _gyro);
-            imuTakeMean(_accelSum, GS_TO_MSS, _accel);
+            updateRotation();
+        }
+
+        /**
+          * Computes the new position and velocity (xnew, indexed by
+          * STATE_Z ... STATE_DZ), quaternion, and the Jacobian of the step,
+          * without modifying the filter.
+          */
+        void predictMean(
+                const axis3_t & gyro,
+                const axis3_t & accel,
+                const float dt,
+                const float reversion,
+                float xnew[STATE_E0],
+                new_quat_t & quat_predicted,
+                jacobian_t & F)
+        {
+            const auto dt2 = dt * dt;
 
             const auto xold = _ekf.x;
 
             // Position updates in the body frame (will be rotated to inertial
             // frame); thrust can only be produced in the body's Z direction
-            const auto dx = xold[STATE_DX] * dt + _accel.x * dt2 / 2;
-            const auto dy = xold[STATE_DY] * dt + _accel.y * dt2 / 2;
-            const auto dz = xold[STATE_DZ] * dt + _accel.z * dt2 / 2; 
+            const auto dx = xold[STATE_DX] * dt + accel.x * dt2 / 2;
+            const auto dy = xold[STATE_DY] * dt + accel.y * dt2 / 2;
+            const auto dz = xold[STATE_DZ] * dt + accel.z * dt2 / 2; 
 
-            const auto accx = _accel.x;
-            const auto accy = _accel.y;
+            const auto accx = accel.x;
+            const auto accy = accel.y;
 
             // attitude update (rotate by gyroscope), we do this in quaternions
             // this is the gyroscope angular velocity integrated over the
             // sample period
-            const auto dtwx = dt*_gyro.x;
-            const auto dtwy = dt*_gyro.y;
-            const auto dtwz = dt*_gyro.z;
+            const auto dtwx = dt*gyro.x;
+            const auto dtwy = dt*gyro.y;
+            const auto dtwz = dt*gyro.z;
 
             // compute the quaternion values in [w,x,y,z] order
             const auto angle = sqrt(dtwx*dtwx + dtwy*dtwy + dtwz*dtwz) + EPS;
@@ -130,13 +861,13 @@ class EKF {
             const auto qz = _quat.z;
 
             const auto tmpq0 = rotateQuat(
-                    dqw*qw - dqx*qx - dqy*qy - dqz*qz, QW_INIT);
+                    dqw*qw - dqx*qx - dqy*qy - dqz*qz, QW_INIT, reversion);
             const auto tmpq1 = rotateQuat(
-                    dqx*qw + dqw*qx + dqz*qy - dqy*qz, QX_INIT);
+                    dqx*qw + dqw*qx + dqz*qy - dqy*qz, QX_INIT, reversion);
             const auto tmpq2 = rotateQuat(
-                    dqy*qw - dqz*qx + dqw*qy + dqx*qz, QY_INIT);
+                    dqy*qw - dqz*qx + dqw*qy + dqx*qz, QY_INIT, reversion);
             const auto tmpq3 = rotateQuat(
-                    dqz*qw + dqy*qx - dqx*qy + dqw*qz, QZ_INIT);
+                    dqz*qw + dqy*qx - dqx*qy + dqw*qz, QZ_INIT, reversion);
 
             // normalize and store the result
             const auto norm = 
@@ -158,125 +889,119 @@ class EKF {
                 _r.x * dx + _r.y * dy + _r.z * dz - GS_TO_MSS * dt2 / 2;
 
             const auto new_dx = xold[STATE_DX] +
-                dt * (accx + _gyro.z * tmpSDY - _gyro.y * tmpSDZ -
+                dt * (accx + gyro.z * tmpSDY - gyro.y * tmpSDZ -
                         GS_TO_MSS * _r.x);
 
             const auto new_dy = xold[STATE_DY] + 
-                dt * (accy - _gyro.z * tmpSDX + _gyro.x * tmpSDZ - 
+                dt * (accy - gyro.z * tmpSDX + gyro.x * tmpSDZ - 
                         GS_TO_MSS * _r.y);
 
             const auto new_dz = xold[STATE_DZ] +
-                dt * (_accel.z + _gyro.y * tmpSDX - _gyro.x * tmpSDY - 
+                dt * (accel.z + gyro.y * tmpSDX - gyro.x * tmpSDY - 
                         GS_TO_MSS * _r.z); 
 
-            new_quat_t quat_predicted = {};
+            xnew[STATE_Z]  = new_z;
+            xnew[STATE_DX] = new_dx;
+            xnew[STATE_DY] = new_dy;
+            xnew[STATE_DZ] = new_dz;
 
             quat_predicted.w = tmpq0/norm;
             quat_predicted.x = tmpq1/norm; 
             quat_predicted.y = tmpq2/norm; 
             quat_predicted.z = tmpq3/norm;
 
-            const auto e0 = _gyro.x*dt/2;
-            const auto e1 = _gyro.y*dt/2;
-            const auto e2 = _gyro.z*dt/2;
+            const auto e0 = gyro.x*dt/2;
+            const auto e1 = gyro.y*dt/2;
+            const auto e2 = gyro.z*dt/2;
 
             // altitude from body-frame velocity
-            const auto z_dx = _r.x*dt;
-            const auto z_dy = _r.y*dt;
-            const auto z_dz = _r.z*dt;
+            F.zrow[0] = _r.x*dt;
+            F.zrow[1] = _r.y*dt;
+            F.zrow[2] = _r.z*dt;
 
             // altitude from attitude error
-            const auto z_e0 = (new_dy*_r.z - new_dz*_r.y)*dt;
-            const auto z_e1 = (-new_dx*_r.z + new_dz*_r.x)*dt;
-            const auto z_e2 = (new_dx*_r.y - new_dy*_r.x)*dt;
-
-            // body-frame velocity from body-frame velocity
-            const auto dx_dx = 1; //drag negligible
-            const auto dx_dy = _gyro.z*dt;
-            const auto dx_dz = _gyro.y*dt;
-            const auto dx_e0 = 0;
-            const auto dx_e2 = -GS_TO_MSS*_r.y*dt;
-            const auto dx_e1 = GS_TO_MSS*_r.z*dt;
-
-            const auto dy_dx =  -_gyro.z*dt;
-            const auto dy_dy = 1; //drag negligible
-            const auto dy_dz = _gyro.x*dt;
-            const auto dy_e0 = -GS_TO_MSS*_r.z*dt;
-            const auto dy_e1 = 0;
-            const auto dy_e2 = GS_TO_MSS*_r.x*dt;
-
-            const auto dz_dx = _gyro.y*dt;
-            const auto dz_dy = _gyro.x*dt;
-            const auto dz_dz = 1; //drag negligible
-            const auto dz_e0 = GS_TO_MSS*_r.y*dt;
-            const auto dz_e1 = -GS_TO_MSS*_r.x*dt;
-            const auto dz_e2 = 0;
-
-            const auto e0_e0 =  1 - e1*e1/2 - e2*e2/2;
-            const auto e0_e1 =  e2 + e0*e1/2;
-            const auto e0_e2 = -e1 + e0*e2/2;
-
-            const auto e1_e0 =  -e2 + e0*e1/2;
-            const auto e1_e1 = 1 - e0*e0/2 - e2*e2/2;
-            const auto e1_e2 = e0 + e1*e2/2;
-
-            const auto e2_e0 = e1 + e0*e2/2;
-            const auto e2_e1 = -e0 + e1*e2/2;
-            const auto e2_e2 = 1 - e0*e0/2 - e1*e1/2;
-
-            // Jacobian of state-transition function
-            const float F[EKF_N*EKF_N] = {
-
-                0, z_dx,  z_dy,  z_dz,  z_e0,  z_e1,  z_e2, 
-                0, dx_dx, dx_dy, dx_dz, dx_e0, dx_e1, dx_e2, 
-                0, dy_dx, dy_dy, dy_dz, dy_e0, dy_e1, dy_e2,
-                0, dz_dx, dz_dy, dz_dz, dz_e0, dz_e1, dz_e2,
-                0, 0,     0,     0,     e0_e0, e0_e1, e0_e2,
-                0, 0,     0,     0,     e1_e0, e1_e1, e1_e2,
-                0, 0,     0,     0,     e2_e0, e2_e1, e2_e2
-            };
+            F.zrow[3] = (new_dy*_r.z - new_dz*_r.y)*dt;
+            F.zrow[4] = (-new_dx*_r.z + new_dz*_r.x)*dt;
+            F.zrow[5] = (new_dx*_r.y - new_dy*_r.x)*dt;
+
+            // body-frame velocity from body-frame velocity; drag negligible
+            F.VV[0][0] = 1;
+            F.VV[0][1] = gyro.z*dt;
+            F.VV[0][2] = gyro.y*dt;
+
+            F.VV[1][0] = -gyro.z*dt;
+            F.VV[1][1] = 1;
+            F.VV[1][2] = gyro.x*dt;
+
+            F.VV[2][0] = gyro.y*dt;
+            F.VV[2][1] = gyro.x*dt;
+            F.VV[2][2] = 1;
+
+            // body-frame velocity from attitude error
+            F.VE[0][0] = 0;
+            F.VE[0][1] = GS_TO_MSS*_r.z*dt;
+            F.VE[0][2] = -GS_TO_MSS*_r.y*dt;
+
+            F.VE[1][0] = -GS_TO_MSS*_r.z*dt;
+            F.VE[1][1] = 0;
+            F.VE[1][2] = GS_TO_MSS*_r.x*dt;
+
+            F.VE[2][0] = GS_TO_MSS*_r.y*dt;
+            F.VE[2][1] = -GS_TO_MSS*_r.x*dt;
+            F.VE[2][2] = 0;
+
+            // attitude error from attitude error
+            F.EE[0][0] =  1 - e1*e1/2 - e2*e2/2;
+            F.EE[0][1] =  e2 + e0*e1/2;
+            F.EE[0][2] = -e1 + e0*e2/2;
+
+            F.EE[1][0] =  -e2 + e0*e1/2;
+            F.EE[1][1] = 1 - e0*e0/2 - e2*e2/2;
+            F.EE[1][2] = e0 + e1*e2/2;
+
+            F.EE[2][0] = e1 + e0*e2/2;
+            F.EE[2][1] = -e0 + e1*e2/2;
+            F.EE[2][2] = 1 - e0*e0/2 - e1*e1/2;
+        }
 
+        /**
+          * acc <- F acc, for Jacobians of the block form above:
+          *
+          *   zrow <- [zv VV_acc,  zv VE_acc + ze EE_acc]
+          *   VV <- VV VV_acc,  VE <- VV VE_acc + VE EE_acc,  EE <- EE EE_acc
+          */
+        static void accumulateJacobian(const jacobian_t & F, jacobian_t & acc)
+        {
+            jacobian_t out = {};
 
-            float fx[EKF_N] = {
+            for (uint8_t j=0; j<3; ++j) {
 
-                xold[STATE_Z] ,
-                xold[STATE_DX],
-                xold[STATE_DY],
-                xold[STATE_DZ],
-                xold[STATE_E0],
-                xold[STATE_E1],
-                xold[STATE_E2]
-            };
+                for (uint8_t k=0; k<3; ++k) {
 
-            // Avoid multiple updates within 1 msec of each other
-            static uint32_t _lastProcessNoiseUpdateMsec;
-            if (nowMsec - _lastProcessNoiseUpdateMsec > 0) {
+                    out.zrow[j] += F.zrow[k] * acc.VV[k][j];
 
-                _lastProcessNoiseUpdateMsec = nowMsec;
+                    out.zrow[3+j] += F.zrow[k] * acc.VE[k][j] +
+                        F.zrow[3+k] * acc.EE[k][j];
+                }
 
-                fx[STATE_Z]  = new_z;
-                fx[STATE_DX] = new_dx;
-                fx[STATE_DY] = new_dy;
-                fx[STATE_DZ] = new_dz;
+                for (uint8_t i=0; i<3; ++i) {
 
-                _quat.w = quat_predicted.w;
-                _quat.x = quat_predicted.x;
-                _quat.y = quat_predicted.y;
-                _quat.z = quat_predicted.z;
+                    for (uint8_t k=0; k<3; ++k) {
 
-                memset(&_gyroSum, 0, sizeof(_gyroSum));
-                memset(&_accelSum, 0, sizeof(_accelSum));
-            }
+                        out.VV[i][j] += F.VV[i][k] * acc.VV[k][j];
 
-            // We'll add process noise after final update
-            const float Q[EKF_N*EKF_N] = {};
+                        out.VE[i][j] += F.VV[i][k] * acc.VE[k][j] +
+                            F.VE[i][k] * acc.EE[k][j];
 
-            ekf_predict(&_ekf, fx, F, Q);
+                        out.EE[i][j] += F.EE[i][k] * acc.EE[k][j];
+                    }
+                }
+            }
 
-            cleanupCovariance();
+            acc = out;
         }
 
-        void update_with_range(const float distance, const uint32_t nowMsec)
+        void fuseRange(const float distance)
         {
             const auto x = _ekf.x;
 
@@ -287,7 +1012,7 @@ class EKF {
             const auto predictedDistance = x[STATE_Z] / cosf(angle);
 
             const auto measuredDistance = distance / 1000.f; // mm => m
-            float h[EKF_N] = {};
+            float h[N] = {};
 
             h[0] = 1/cosf(angle);
 
@@ -302,15 +1027,17 @@ class EKF {
             }
         }
 
-        void update_with_flow(const float dt, const float dx, const float dy)
+        void fuseFlow(const logged_measurement_t & m)
         {
-            return;
+            const auto dt = m.flowDt;
+            const auto dx = m.flowDx;
+            const auto dy = m.flowDy;
 
-            // Inclusion of flow measurements in the EKF done by two scalar
-            // updates
+            // Inclusion of flow measurements in the EKF done by a single
+            // joint update of the x and y pixel counts
 
             //~~~ Body rates ~~~
-            const auto omegay_b = _gyroLatest.y * DEGREES_TO_RADIANS;
+            const auto omegay_b = m.omegaY;
 
             const auto x = _ekf.x;
 
@@ -327,16 +1054,14 @@ class EKF {
             auto measuredNX = dx*FLOW_RESOLUTION;
 
             // derive measurement equation with respect to dx (and z?)
-            float hx[EKF_N] = {};
+            float H[2][N] = {};
+            auto * hx = H[0];
             hx[0] = (FLOW_NPIX * dt / FLOW_THETAPIX) * ((_r.z * dx_g) /
                     (-z_g * z_g));
             hx[1] = (FLOW_NPIX * dt / FLOW_THETAPIX) * (_r.z / z_g);
 
-            // Inclusion of flow measurements in the EKF done by two scalar
-            // updates
-
             //~~~ Body rates ~~~
-            const auto omegax_b = _gyroLatest.x * DEGREES_TO_RADIANS;
+            const auto omegax_b = m.omegaX;
 
             const auto dy_g = x[STATE_DY];
 
@@ -346,21 +1071,25 @@ class EKF {
             auto measuredNY = dy*FLOW_RESOLUTION;
 
             // derive measurement equation with respect to dy (and z?)
-            float hy[EKF_N] = {};
+            auto * hy = H[1];
             hy[0] = (FLOW_NPIX * dt / FLOW_THETAPIX) * ((_r.z * dy_g) / (-z_g * z_g));
             hy[2] = (FLOW_NPIX * dt / FLOW_THETAPIX) * (_r.z / z_g);
 
             const auto r = square(FLOW_STD_FIXED * FLOW_RESOLUTION);
 
-            update_with_scalar(measuredNX, predictedNX, hx, r);
+            const float measured[2] = { measuredNX, measuredNY };
+            const float predicted[2] = { predictedNX, predictedNY };
+
+            _ekf.template update<2>(measured, predicted, H, r);
 
-            update_with_scalar(measuredNY, predictedNY, hy, r);
+            cleanupCovariance();
+
+            _isUpdated = true;
         }
 
-        /**
-          * Returns false if state is OOB, true otherwise
-          */
-        bool finalize(const uint32_t nowMsec)
+        // Folds the attitude error into the quaternion and resets it, after
+        // one or more measurement updates
+        void incorporateAttitudeError(void)
         {
             const auto x = _ekf.x;
 
@@ -404,7 +1133,7 @@ class EKF {
             _quat.y = isErrorSufficient ? tmpq2 / norm : _quat.y;
             _quat.z = isErrorSufficient ? tmpq3 / norm : _quat.z;
 
-            const float newx[EKF_N] = {
+            const float newx[N] = {
                 x[STATE_Z],
                 x[STATE_DX],
                 x[STATE_DY],
@@ -414,9 +1143,7 @@ class EKF {
                 0  // E2
             };
 
-            _r.x = 2 * _quat.x * _quat.z - 2 * _quat.w * _quat.y;
-            _r.y = 2 * _quat.y * _quat.z + 2 * _quat.w * _quat.x; 
-            _r.z = _quat.w*_quat.w-_quat.x*_quat.x-_quat.y*_quat.y+_quat.z*_quat.z;
+            updateRotation();
 
             // the attitude error vector (v0,v1,v2) is small,
             // so we use a first order approximation to e0 = tan(|v0|/2)*v0/|v0|
@@ -424,216 +1151,261 @@ class EKF {
             const auto e1 = v1 / 2; 
             const auto e2 = v2 / 2;
 
-            const auto dx_dx = 1;
-            const auto dy_dy = 1;
-            const auto dz_dz = 1;
-
-            const auto e0_e0 =  1 - e1*e1/2 - e2*e2/2;
-            const auto e0_e1 =  e2 + e0*e1/2;
-            const auto e0_e2 = -e1 + e0*e2/2;
-
-            const auto e1_e0 =  -e2 + e0*e1/2;
-            const auto e1_e1 = 1 - e0*e0/2 - e2*e2/2;
-            const auto e1_e2 = e0 + e1*e2/2;
-
-            const auto e2_e0 = e1 + e0*e2/2;
-            const auto e2_e1 = -e0 + e1*e2/2;
-            const auto e2_e2 = 1 - e0*e0/2 - e1*e1/2;
-
-            const float A[EKF_N*EKF_N] = {
-                0, 0,     0,     0,     0,     0,     0,
-                0, dx_dx, 0,     0,     0,     0,     0,
-                0, 0,     dy_dy, 0,     0,     0,     0,
-                0, 0,     0,     dz_dz, 0,     0,     0,
-                0, 0,     0,     0,     e0_e0, e0_e1, e0_e2,
-                0, 0,     0,     0,     e1_e0, e1_e1, e1_e2,
-                0, 0,     0,     0,     e2_e0, e2_e1, e2_e2
+            // Attitude block of the reset Jacobian, which is otherwise zero
+            // on the altitude and the identity on the velocities
+            const float EE[3][3] = {
+                {  1 - e1*e1/2 - e2*e2/2,  e2 + e0*e1/2,          -e1 + e0*e2/2 },
+                { -e2 + e0*e1/2,           1 - e0*e0/2 - e2*e2/2,  e0 + e1*e2/2 },
+                {  e1 + e0*e2/2,          -e0 + e1*e2/2,           1 - e0*e0/2 - e1*e1/2 }
             };
 
             if (_isUpdated) {
 
-                for (uint8_t i=0; i<EKF_N; ++i) {
+                for (uint8_t i=0; i<N; ++i) {
                     _ekf.x[i] = newx[i];
                 }
 
                 if (isErrorSufficient) {
 
-                    ekf_custom_multiply_covariance(&_ekf, A);
+                    resetAttitudeCovariance(EE, _ekf);
 
                     cleanupCovariance();
                 }
 
                 _isUpdated = false;
             }
-
-            return
-                isPositionWithinBounds(newx[STATE_Z]) &&
-                isVelocityWithinBounds(newx[STATE_DX]) &&
-                isVelocityWithinBounds(newx[STATE_DY]) &&
-                isVelocityWithinBounds(newx[STATE_DZ]);
         }
 
-        void get_vehicle_state(vehicleState_t & state, const uint32_t nowMsec)
+        void updateEuler(void)
         {
-            const auto x = _ekf.x;
-
-            state.dx = x[STATE_DX];
-
-            state.dy = x[STATE_DY];
-
-            state.z = x[STATE_Z];
-
-            state.z = min(0, state.z);
-
-            state.dz = _r.x * x[STATE_DX] + _r.y * x[STATE_DY] + 
-                _r.z * x[STATE_DZ];
-
-            // Pack Z and DZ into a single float for transmission to client
-#if !defined(ARDUINO)
-            const int8_t sgn = state.dz < 0 ? -1 : +1;
-            const float s = 1000;
-            state.z_dz = (int)(state.dz * s) + sgn * state.z / s;
-#endif
-
             const auto qw = _quat.w;
             const auto qx = _quat.x;
             const auto qy = _quat.y;
             const auto qz = _quat.z;
 
-            state.phi = RADIANS_TO_DEGREES * atan2((2 * (qy*qz + qw*qx)),
+            _phi = RADIANS_TO_DEGREES * atan2((2 * (qy*qz + qw*qx)),
                     (qw*qw - qx*qx - qy*qy + qz*qz));
 
             // Negate for ENU
-            state.theta = -RADIANS_TO_DEGREES * asin((-2) * (qx*qz - qw*qy));
+            _theta = -RADIANS_TO_DEGREES * asin((-2) * (qx*qz - qw*qy));
 
-            state.psi = RADIANS_TO_DEGREES * atan2((2 * (qx*qy + qw*qz)),
+            _psi = RADIANS_TO_DEGREES * atan2((2 * (qx*qy + qw*qz)),
                     (qw*qw + qx*qx - qy*qy - qz*qz));
 
-            // Get angular velocities directly from gyro
-            state.dphi =    _gyroLatest.x;
-            state.dtheta = -_gyroLatest.y; // negate for ENU
-            state.dpsi =    _gyroLatest.z;
-
+            _eulerQuat = _quat;
         }
-    private:
-
-        // Initial variances, uncertain of position, but know we're
-        // stationary and roughly flat
-        static constexpr float STDEV_INITIAL_POSITION_Z = 1;
-        static constexpr float STDEV_INITIAL_VELOCITY = 0.01;
-        static constexpr float STDEV_INITIAL_ATTITUDE_ROLL_PITCH = 0.01;
-        static constexpr float STDEV_INITIAL_ATTITUDE_YAW = 0.01;
 
-        // The bounds on the covariance, these shouldn't be hit, but sometimes
-        // are... why?
-        static constexpr float MAX_COVARIANCE = 100;
-        static constexpr float MIN_COVARIANCE = 1e-6;
-
-        // Quaternion used for initial orientation
-        static constexpr float QW_INIT = 1;
-        static constexpr float QX_INIT = 0;
-        static constexpr float QY_INIT = 0;
-        static constexpr float QZ_INIT = 0;
+        // Third row of the rotation matrix, from the quaternion
+        void updateRotation(void)
+        {
+            _r.x = 2 * _quat.x * _quat.z - 2 * _quat.w * _quat.y;
+            _r.y = 2 * _quat.y * _quat.z + 2 * _quat.w * _quat.x; 
+            _r.z = _quat.w*_quat.w-_quat.x*_quat.x-_quat.y*_quat.y+_quat.z*_quat.z;
+        }
 
-        // ~~~ Camera constexprants ~~~
-        // The angle of aperture is guessed from the raw data register and
-        // thankfully look to be symmetric
+        void propagateCovariance(const jacobian_t & F)
+        {
+            propagateCovariance(F, _ekf);
+        }
 
-        static constexpr float FLOW_NPIX = 35.0;   // [pixels] (same in x and y)
+        /**
+          * P <- F P F^T for the block-sparse F built in predictMean().  Only
+          * the velocity/attitude rows and columns of the old P contribute,
+          * and the attitude rows of F see only the attitude columns.
+          */
+        void propagateCovariance(const jacobian_t & F, PackedEkf<N, M> & ekf)
+        {
+            typedef PackedEkf<N, M> packed_t;
+
+            const auto zrow = F.zrow;
+            const auto VV = F.VV;
+            const auto VE = F.VE;
+            const auto EE = F.EE;
+
+            // Q: lower-right 6x6 block of P
+            float Q[6][6];
+            for (uint8_t i=0; i<6; ++i) {
+                for (uint8_t j=i; j<6; ++j) {
+                    Q[i][j] = Q[j][i] = ekf.get(i+1, j+1);
+                }
+            }
 
-        // 2*sin(42/2); 42degree is the agnle of aperture, here we computed the
-        // corresponding ground length
-        static constexpr float FLOW_THETAPIX = 0.71674;
+            // B Q, where B is the lower-right 6x6 block of F; for the
+            // attitude rows we only need the attitude columns
+            float BQ[6][6];
+            for (uint8_t i=0; i<3; ++i) {
+                for (uint8_t j=0; j<6; ++j) {
+                    BQ[i][j] = velocityRow(VV[i], VE[i], Q[0][j], Q[1][j],
+                            Q[2][j], Q[3][j], Q[4][j], Q[5][j]);
+                }
+            }
+            for (uint8_t i=0; i<3; ++i) {
+                for (uint8_t j=3; j<6; ++j) {
+                    BQ[3+i][j] = EE[i][0]*Q[3][j] + EE[i][1]*Q[4][j] +
+                        EE[i][2]*Q[5][j];
+                }
+            }
 
-        static constexpr float GS_TO_MSS = 9.81;
+            // Row zero: zrow Q B^T = (B Q zrow^T)^T
+            float u[6] = {};
+            for (uint8_t i=0; i<6; ++i) {
+                for (uint8_t k=0; k<6; ++k) {
+                    u[i] += Q[i][k] * zrow[k];
+                }
+            }
 
-        //We do get the measurements in 10x the motion pixels (experimentally
-        //measured)
-        static constexpr float FLOW_RESOLUTION = 0.1;
+            auto * P = ekf.P;
 
-        // The bounds on states, these shouldn't be hit...
-        static constexpr float MAX_POSITION = 100; //meters
-        static constexpr float MAX_VELOCITY = 10; //meters per second
+            P[packed_t::index(0, 0)] =
+                zrow[0]*u[0] + zrow[1]*u[1] + zrow[2]*u[2] +
+                zrow[3]*u[3] + zrow[4]*u[4] + zrow[5]*u[5];
 
-        // Small number epsilon, to prevent dividing by zero
-        static constexpr float EPS = 1e-6f;
+            for (uint8_t j=0; j<3; ++j) {
+                P[packed_t::index(0, 1+j)] = velocityRow(VV[j], VE[j],
+                        u[0], u[1], u[2], u[3], u[4], u[5]);
+            }
 
-        // the reversion of pitch and roll to zero
-        static constexpr float ROLLPITCH_ZERO_REVERSION = 0.001;
+            for (uint8_t j=0; j<3; ++j) {
+                P[packed_t::index(0, 4+j)] = EE[j][0]*u[3] + EE[j][1]*u[4] +
+                    EE[j][2]*u[5];
+            }
 
-        static constexpr uint16_t RANGEFINDER_OUTLIER_LIMIT_MM = 5000;
+            // Velocity rows: (B Q) B^T
+            for (uint8_t i=0; i<3; ++i) {
 
-        // Rangefinder measurement noise model
-        static constexpr float RANGEFINDER_EXP_POINT_A = 2.5;
-        static constexpr float RANGEFINDER_EXP_STD_A = 0.0025; 
-        static constexpr float RANGEFINDER_EXP_POINT_B = 4.0;
-        static constexpr float RANGEFINDER_EXP_STD_B = 0.2;   
+                const auto * m = BQ[i];
 
-        static constexpr float RANGEFINDER_EXP_COEFF = 
-            logf( RANGEFINDER_EXP_STD_B / RANGEFINDER_EXP_STD_A) / 
-            (RANGEFINDER_EXP_POINT_B - RANGEFINDER_EXP_POINT_A);
+                for (uint8_t j=i; j<3; ++j) {
+                    P[packed_t::index(1+i, 1+j)] = velocityRow(VV[j], VE[j],
+                            m[0], m[1], m[2], m[3], m[4], m[5]);
+                }
 
-        static constexpr float FLOW_STD_FIXED = 2.0;
+                for (uint8_t j=0; j<3; ++j) {
+                    P[packed_t::index(1+i, 4+j)] = EE[j][0]*m[3] +
+                        EE[j][1]*m[4] + EE[j][2]*m[5];
+                }
+            }
 
-        ekf_t _ekf;
+            // Attitude rows, upper triangle
+            for (uint8_t i=0; i<3; ++i) {
+                for (uint8_t j=i; j<3; ++j) {
+                    P[packed_t::index(4+i, 4+j)] = EE[j][0]*BQ[3+i][3] +
+                        EE[j][1]*BQ[3+i][4] + EE[j][2]*BQ[3+i][5];
+                }
+            }
+        }
 
-        void update_with_scalar(
-                const float z,
-                const float hx,
-                const float h[EKF_N], 
-                const float r)
+        /**
+          * Cores without a sparse kernel take F in full, through their
+          * predict(): the UD core, whose factors are updated by Thornton's
+          * method, and the packed core's dense reference on the host
+          */
+        template <class DenseCore>
+        void propagateCovariance(const jacobian_t & F, DenseCore & ekf)
         {
-            ekf_custom_scalar_update(&_ekf, z, hx, h, r);
+            float A[N*N] = {};
 
-            cleanupCovariance();
-
-            _isUpdated = true;
-        }
+            for (uint8_t j=0; j<6; ++j) {
+                A[STATE_Z*N + 1+j] = F.zrow[j];
+            }
 
-        typedef struct {
+            for (uint8_t i=0; i<3; ++i) {
+                for (uint8_t j=0; j<3; ++j) {
+                    A[(STATE_DX+i)*N + STATE_DX+j] = F.VV[i][j];
+                    A[(STATE_DX+i)*N + STATE_E0+j] = F.VE[i][j];
+                    A[(STATE_E0+i)*N + STATE_E0+j] = F.EE[i][j];
+                }
+            }
 
-            float w;
-            float x;
-            float y;
-            float z;
+            // The mean has already been propagated
+            float fx[N] = {};
+            memcpy(fx, ekf.x, sizeof(fx));
 
-        } new_quat_t;
+            ekf.predict(fx, A);
+        }
 
-        typedef struct {
+        /**
+          * P <- A P A^T for the attitude-reset Jacobian.  The velocity
+          * block is unchanged and the altitude row and column go to zero,
+          * so only the attitude rows need any arithmetic: EE P_ee EE^T, and
+          * P_ve EE^T for their cross terms with the velocities.
+          */
+        void resetAttitudeCovariance(
+                const float EE[3][3], PackedEkf<N, M> & ekf)
+        {
+            typedef PackedEkf<N, M> packed_t;
 
-            axis3_t sum;
-            uint32_t count;
+            auto * P = ekf.P;
 
-        } imu_t;
+            // Attitude columns of the velocity and attitude rows
+            float PE[6][3];
+            for (uint8_t i=0; i<6; ++i) {
+                for (uint8_t k=0; k<3; ++k) {
+                    PE[i][k] = P[packed_t::index(1+i, 4+k)];
+                }
+            }
 
-        axis3_t _gyroLatest;
+            for (uint8_t j=0; j<N; ++j) {
+                P[packed_t::index(0, j)] = 0;
+            }
 
-        new_quat_t _quat;
+            for (uint8_t i=0; i<3; ++i) {
+                for (uint8_t j=0; j<3; ++j) {
+                    P[packed_t::index(1+i, 4+j)] = PE[i][0]*EE[j][0] +
+                        PE[i][1]*EE[j][1] + PE[i][2]*EE[j][2];
+                }
+            }
 
-        bool _isUpdated;
+            // EE P_ee
+            float EP[3][3];
+            for (uint8_t i=0; i<3; ++i) {
+                for (uint8_t j=0; j<3; ++j) {
+                    EP[i][j] = EE[i][0]*PE[3][j] + EE[i][1]*PE[4][j] +
+                        EE[i][2]*PE[5][j];
+                }
+            }
 
-        uint32_t _nextPredictionMsec;
+            for (uint8_t i=0; i<3; ++i) {
+                for (uint8_t j=i; j<3; ++j) {
+                    P[packed_t::index(4+i, 4+j)] = EP[i][0]*EE[j][0] +
+                        EP[i][1]*EE[j][1] + EP[i][2]*EE[j][2];
+                }
+            }
+        }
 
-        axis3_t _r;
+        template <class DenseCore>
+        void resetAttitudeCovariance(const float EE[3][3], DenseCore & ekf)
+        {
+            float A[N*N] = {};
 
-        imu_t _gyroSum;
-        imu_t _accelSum;
+            for (uint8_t i=0; i<3; ++i) {
+                A[(STATE_DX+i)*N + STATE_DX+i] = 1;
+                for (uint8_t j=0; j<3; ++j) {
+                    A[(STATE_E0+i)*N + STATE_E0+j] = EE[i][j];
+                }
+            }
 
-        // Indexes to access the state
-        enum {
+            ekf.multiply_covariance(A);
+        }
 
-            STATE_Z,
-            STATE_DX,
-            STATE_DY,
-            STATE_DZ,
-            STATE_E0,
-            STATE_E1,
-            STATE_E2
-        };
+        // One velocity row of B times a column (v, e)
+        static float velocityRow(
+                const float vv[3],
+                const float ve[3],
+                const float v0,
+                const float v1,
+                const float v2,
+                const float e0,
+                const float e1,
+                const float e2)
+        {
+            return vv[0]*v0 + vv[1]*v1 + vv[2]*v2 + ve[0]*e0 + ve[1]*e1 +
+                ve[2]*e2;
+        }
 
         void cleanupCovariance(void)
         {
-            ekf_custom_cleanup_covariance(&_ekf, MIN_COVARIANCE, MAX_COVARIANCE);
+            _ekf.cleanup_covariance(MIN_COVARIANCE, MAX_COVARIANCE);
         }
 
         static void imuAccum(const axis3_t vals, imu_t & imu)
@@ -661,20 +1433,20 @@ class EKF {
                 isCountNonzero ? imu.sum.z * conversionFactor / count : mean.z;
         }
 
-        static const float max(const float val, const float maxval)
+        static float max(const float val, const float maxval)
         {
             return val > maxval ? maxval : val;
         }
 
-        static const float min(const float val, const float maxval)
+        static float min(const float val, const float maxval)
         {
             return val < maxval ? maxval : val;
         }
 
-        static float rotateQuat(const float val, const float initVal)
+        static float rotateQuat(
+                const float val, const float initVal, const float reversion)
         {
-            return (val * (1 - ROLLPITCH_ZERO_REVERSION)) + 
-                (ROLLPITCH_ZERO_REVERSION * initVal);
+            return (val * (1 - reversion)) + (reversion * initVal);
         }
 
         static bool isPositionWithinBounds(const float pos)
@@ -703,6 +1475,10 @@ class EKF {
         }
 };
 
+typedef BasicEKF<PackedEkf> EKF;
+
+typedef BasicEKF<UdEkf> UdEKF;
+
 #if defined(ARDUINO)
 }
 #endif
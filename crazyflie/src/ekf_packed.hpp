@@ -0,0 +1,300 @@
+/**
+ * Extended Kalman Filter core with packed-symmetric covariance storage
+ *
+ * Copyright (C) 2024 Simon D. Levy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * The covariance P is symmetric, so we store only its upper triangle
+ * (including the diagonal), row by row:
+ *
+ *   P[0][0] P[0][1] ... P[0][N-1] P[1][1] P[1][2] ... P[N-1][N-1]
+ *
+ * For the seven-state (z, dx, dy, dz, e0, e1, e2) filter this is 28 floats
+ * instead of 49.  Because every kernel writes only the upper triangle, P is
+ * symmetric by construction and the cleanup pass just has to clamp values.
+ *
+ * N is the number of states and M the largest number of measurements fused
+ * in a single update.  Both are template parameters, so several filter
+ * configurations can live in one binary and every loop has a compile-time
+ * trip count.  The firmware is built for size, which doesn't unroll those
+ * loops, so the kernels that read P all over unpack it into a square on
+ * the stack first rather than computing a packed index per element.
+ */
+template <uint8_t N, uint8_t M>
+class PackedEkf {
+
+    public:
+
+        static const uint8_t NP = N * (N + 1) / 2;
+
+        float x[N];
+
+        float P[NP];
+
+        void initialize(const float pdiag[N])
+        {
+            memset(x, 0, sizeof(x));
+            memset(P, 0, sizeof(P));
+
+            for (uint8_t i=0; i<N; ++i) {
+                P[index(i, i)] = pdiag[i];
+            }
+        }
+
+        float get(const uint8_t i, const uint8_t j) const
+        {
+            return P[index(i, j)];
+        }
+
+        /**
+         * x <- fx, P <- F P F^T
+         */
+        void predict(const float fx[N], const float F[N*N])
+        {
+            memcpy(x, fx, sizeof(x));
+
+            multiply_covariance(F);
+        }
+
+        /**
+         * P <- A P A^T, computing only the upper triangle of the result
+         */
+        void multiply_covariance(const float A[N*N])
+        {
+            float Ps[N][N];
+            unpack(Ps);
+
+            // AP = A P
+            float AP[N][N];
+            for (uint8_t i=0; i<N; ++i) {
+                for (uint8_t j=0; j<N; ++j) {
+                    float s = 0;
+                    for (uint8_t k=0; k<N; ++k) {
+                        s += A[i*N+k] * Ps[k][j];
+                    }
+                    AP[i][j] = s;
+                }
+            }
+
+            // P = AP A^T, upper triangle only
+            uint8_t n = 0;
+            for (uint8_t i=0; i<N; ++i) {
+                for (uint8_t j=i; j<N; ++j) {
+                    float s = 0;
+                    for (uint8_t k=0; k<N; ++k) {
+                        s += AP[i][k] * A[j*N+k];
+                    }
+                    P[n++] = s;
+                }
+            }
+        }
+
+        /**
+         * Scalar measurement update.  For a single measurement the Joseph
+         * form (I - gh) P (I - gh)^T + g r g^T reduces to P - (Ph)(Ph)^T / S,
+         * with S = hPh^T + r, which we apply to the upper triangle only.
+         */
+        void scalar_update(
+                const float z,
+                const float hx,
+                const float h[N],
+                const float r)
+        {
+            float Ps[N][N];
+            unpack(Ps);
+
+            float ph[N] = {};
+            for (uint8_t i=0; i<N; ++i) {
+                for (uint8_t j=0; j<N; ++j) {
+                    ph[i] += Ps[i][j] * h[j];
+                }
+            }
+
+            float hphr = r;
+            for (uint8_t i=0; i<N; ++i) {
+                hphr += h[i] * ph[i];
+            }
+
+            const auto innovation = (z - hx) / hphr;
+
+            for (uint8_t i=0; i<N; ++i) {
+                x[i] += ph[i] * innovation;
+            }
+
+            uint8_t n = 0;
+            for (uint8_t i=0; i<N; ++i) {
+                const auto gi = ph[i] / hphr;
+                for (uint8_t j=i; j<N; ++j) {
+                    P[n++] -= gi * ph[j];
+                }
+            }
+        }
+
+        /**
+         * Joint update for K <= M measurements with uncorrelated noise of
+         * variance r.  The KxK innovation covariance S = HPH^T + rI is
+         * inverted directly, giving gains G = PH^T S^-1 and
+         * P <- P - G (PH^T)^T.
+         */
+        template <uint8_t K>
+        void update(
+                const float z[K],
+                const float hx[K],
+                const float H[K][N],
+                const float r)
+        {
+            static_assert(K <= M, "too many measurements for this filter");
+
+            float Ps[N][N];
+            unpack(Ps);
+
+            float ph[K][N] = {};
+            for (uint8_t i=0; i<N; ++i) {
+                for (uint8_t j=0; j<N; ++j) {
+                    const auto p = Ps[i][j];
+                    for (uint8_t k=0; k<K; ++k) {
+                        ph[k][i] += p * H[k][j];
+                    }
+                }
+            }
+
+            float S[K][K] = {};
+            for (uint8_t a=0; a<K; ++a) {
+                S[a][a] = r;
+                for (uint8_t b=0; b<K; ++b) {
+                    for (uint8_t i=0; i<N; ++i) {
+                        S[a][b] += H[a][i] * ph[b][i];
+                    }
+                }
+            }
+
+            float Si[K][K] = {};
+            invert<K>(S, Si);
+
+            float err[K] = {};
+            for (uint8_t a=0; a<K; ++a) {
+                err[a] = z[a] - hx[a];
+            }
+
+            float g[K][N] = {};
+            for (uint8_t i=0; i<N; ++i) {
+                for (uint8_t a=0; a<K; ++a) {
+                    for (uint8_t b=0; b<K; ++b) {
+                        g[a][i] += ph[b][i] * Si[b][a];
+                    }
+                    x[i] += g[a][i] * err[a];
+                }
+            }
+
+            uint8_t n = 0;
+            for (uint8_t i=0; i<N; ++i) {
+                for (uint8_t j=i; j<N; ++j) {
+                    float s = 0;
+                    for (uint8_t a=0; a<K; ++a) {
+                        s += g[a][i] * ph[a][j];
+                    }
+                    P[n++] -= s;
+                }
+            }
+        }
+
+        /**
+         * Keeps the covariance bounded.  Symmetry is guaranteed by the
+         * storage, so unlike the dense version there is nothing to average.
+         */
+        void cleanup_covariance(const float minval, const float maxval)
+        {
+            uint8_t n = 0;
+            for (uint8_t i=0; i<N; ++i) {
+                for (uint8_t j=i; j<N; ++j) {
+                    const auto p = P[n];
+                    P[n++] =
+                        p > maxval ? maxval :
+                        (i == j && p < minval) ? minval :
+                        p;
+                }
+            }
+        }
+
+        static constexpr uint8_t index(const uint8_t i, const uint8_t j)
+        {
+            return i <= j ?
+                i * N - i * (i - 1) / 2 + (j - i) :
+                j * N - j * (j - 1) / 2 + (i - j);
+        }
+
+    private:
+
+        // Copies P into both triangles of a square
+        void unpack(float Ps[N][N]) const
+        {
+            uint8_t n = 0;
+            for (uint8_t i=0; i<N; ++i) {
+                for (uint8_t j=i; j<N; ++j) {
+                    Ps[i][j] = P[n];
+                    Ps[j][i] = P[n++];
+                }
+            }
+        }
+
+        // Inverts the (symmetric, positive-definite) innovation covariance:
+        // closed form for one and two measurements, Gauss-Jordan otherwise
+        template <uint8_t K>
+        static void invert(float S[K][K], float Si[K][K])
+        {
+            if constexpr (K == 1) {
+                Si[0][0] = 1 / S[0][0];
+            }
+
+            else if constexpr (K == 2) {
+                const auto det = S[0][0] * S[1][1] - S[0][1] * S[1][0];
+                Si[0][0] =  S[1][1] / det;
+                Si[0][1] = -S[0][1] / det;
+                Si[1][0] = -S[1][0] / det;
+                Si[1][1] =  S[0][0] / det;
+            }
+
+            else {
+                for (uint8_t i=0; i<K; ++i) {
+                    for (uint8_t j=0; j<K; ++j) {
+                        Si[i][j] = i == j ? 1 : 0;
+                    }
+                }
+
+                for (uint8_t c=0; c<K; ++c) {
+                    const auto d = 1 / S[c][c];
+                    for (uint8_t j=0; j<K; ++j) {
+                        S[c][j] *= d;
+                        Si[c][j] *= d;
+                    }
+                    for (uint8_t i=0; i<K; ++i) {
+                        if (i != c) {
+                            const auto f = S[i][c];
+                            for (uint8_t j=0; j<K; ++j) {
+                                S[i][j] -= f * S[c][j];
+                                Si[i][j] -= f * Si[c][j];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+};
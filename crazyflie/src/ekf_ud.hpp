@@ -0,0 +1,236 @@
+/**
+ * Extended Kalman Filter core with UD-factorized covariance storage
+ *
+ * Copyright (C) 2024 Simon D. Levy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * The covariance is kept as P = U D U^T, with U unit upper-triangular and D
+ * diagonal.  We store the strictly upper triangle of U row by row, and the
+ * diagonal of D:
+ *
+ *   U[0][1] ... U[0][N-1] U[1][2] ... U[N-2][N-1]     D[0] ... D[N-1]
+ *
+ * which for the seven-state filter is the same 28 floats as PackedEkf.
+ *
+ * Time updates use Thornton's modified weighted Gram-Schmidt and
+ * measurement updates Bierman's algorithm, neither of which can make D
+ * negative, so P stays symmetric and positive semi-definite in float32
+ * without any cleanup.  The interface matches PackedEkf, so the two can be
+ * swapped in BasicEKF.
+ */
+template <uint8_t N, uint8_t M>
+class UdEkf {
+
+    public:
+
+        static const uint8_t NU = N * (N - 1) / 2;
+
+        float x[N];
+
+        float U[NU];
+
+        float D[N];
+
+        void initialize(const float pdiag[N])
+        {
+            memset(x, 0, sizeof(x));
+            memset(U, 0, sizeof(U));
+
+            for (uint8_t i=0; i<N; ++i) {
+                D[i] = pdiag[i];
+            }
+        }
+
+        /**
+         * P[i][j], computed from the factors
+         */
+        float get(const uint8_t i, const uint8_t j) const
+        {
+            float s = 0;
+            for (uint8_t k=(i > j ? i : j); k<N; ++k) {
+                s += u(i, k) * D[k] * u(j, k);
+            }
+            return s;
+        }
+
+        /**
+         * x <- fx, P <- F P F^T
+         */
+        void predict(const float fx[N], const float F[N*N])
+        {
+            memcpy(x, fx, sizeof(x));
+
+            multiply_covariance(F);
+        }
+
+        /**
+         * P <- A P A^T, by Thornton's method: W = A U has P = W D W^T, and
+         * orthogonalizing the rows of W against the weights D, from the last
+         * row up, gives the new U and D.
+         */
+        void multiply_covariance(const float A[N*N])
+        {
+            float W[N][N];
+            for (uint8_t i=0; i<N; ++i) {
+                for (uint8_t k=0; k<N; ++k) {
+                    float s = A[i*N+k];
+                    for (uint8_t m=0; m<k; ++m) {
+                        s += A[i*N+m] * U[index(m, k)];
+                    }
+                    W[i][k] = s;
+                }
+            }
+
+            float d[N];
+            memcpy(d, D, sizeof(d));
+
+            for (int8_t j=N-1; j>=0; --j) {
+
+                float dw[N];
+                float sigma = 0;
+                for (uint8_t k=0; k<N; ++k) {
+                    dw[k] = d[k] * W[j][k];
+                    sigma += W[j][k] * dw[k];
+                }
+
+                D[j] = sigma;
+
+                for (uint8_t i=0; i<j; ++i) {
+
+                    float s = 0;
+                    if (sigma > 0) {
+                        for (uint8_t k=0; k<N; ++k) {
+                            s += W[i][k] * dw[k];
+                        }
+                        s /= sigma;
+                    }
+
+                    U[index(i, j)] = s;
+
+                    for (uint8_t k=0; k<N; ++k) {
+                        W[i][k] -= s * W[j][k];
+                    }
+                }
+            }
+        }
+
+        /**
+         * Scalar measurement update by Bierman's algorithm
+         */
+        void scalar_update(
+                const float z,
+                const float hx,
+                const float h[N],
+                const float r)
+        {
+            // f = U^T h, v = D f
+            float f[N];
+            float v[N];
+            for (uint8_t j=0; j<N; ++j) {
+                float s = h[j];
+                for (uint8_t i=0; i<j; ++i) {
+                    s += U[index(i, j)] * h[i];
+                }
+                f[j] = s;
+                v[j] = D[j] * s;
+            }
+
+            // b accumulates the unnormalized gain
+            float b[N];
+            float alpha = r;
+
+            for (uint8_t j=0; j<N; ++j) {
+
+                const auto alphaPrev = alpha;
+                alpha += f[j] * v[j];
+
+                D[j] *= alphaPrev / alpha;
+
+                const auto lambda = -f[j] / alphaPrev;
+
+                b[j] = v[j];
+
+                for (uint8_t i=0; i<j; ++i) {
+                    const auto uij = U[index(i, j)];
+                    U[index(i, j)] = uij + b[i] * lambda;
+                    b[i] += uij * v[j];
+                }
+            }
+
+            const auto innovation = (z - hx) / alpha;
+
+            for (uint8_t i=0; i<N; ++i) {
+                x[i] += b[i] * innovation;
+            }
+        }
+
+        /**
+         * Joint update for K <= M measurements with uncorrelated noise of
+         * variance r, which is exactly a sequence of scalar updates
+         */
+        template <uint8_t K>
+        void update(
+                const float z[K],
+                const float hx[K],
+                const float H[K][N],
+                const float r)
+        {
+            static_assert(K <= M, "too many measurements for this filter");
+
+            // Predicted measurements are linearized about the prior
+            // state, so correct each one for the updates before it
+            float x0[N];
+            memcpy(x0, x, sizeof(x0));
+
+            for (uint8_t k=0; k<K; ++k) {
+
+                float hxk = hx[k];
+                for (uint8_t i=0; i<N; ++i) {
+                    hxk += H[k][i] * (x[i] - x0[i]);
+                }
+
+                scalar_update(z[k], hxk, H[k], r);
+            }
+        }
+
+        /**
+         * The factorization keeps P symmetric and positive semi-definite,
+         * so there is nothing to clean up
+         */
+        void cleanup_covariance(const float minval, const float maxval)
+        {
+            (void)minval;
+            (void)maxval;
+        }
+
+        // Index of U[i][j], i < j, in the packed strictly upper triangle
+        static constexpr uint8_t index(const uint8_t i, const uint8_t j)
+        {
+            return i * (2 * N - i - 1) / 2 + (j - i - 1);
+        }
+
+    private:
+
+        float u(const uint8_t i, const uint8_t k) const
+        {
+            return i == k ? 1 : i < k ? U[index(i, k)] : 0;
+        }
+};
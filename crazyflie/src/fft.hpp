@@ -0,0 +1,191 @@
+/**
+ * Real-input FFT power spectrum, on CMSIS-DSP or in portable C++
+ *
+ * Copyright (C) 2024 Simon D. Levy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+
+#include <m_pi.h>
+
+// Only the firmware build has a Kconfig
+#if defined(ARM_MATH_CM4)
+#include <autoconf.h>
+#endif
+
+#if defined(CONFIG_IMU_GYRO_FFT_CMSIS_DSP)
+#include <arm_math.h>
+#endif
+
+/**
+ * Both versions give the spectrum in the CMSIS packed layout: the real DC
+ * and Nyquist terms, then the real and imaginary parts of bins 1 to N/2-1.
+ * The portable one runs an N/2-point complex FFT on the even and odd
+ * samples taken as real and imaginary parts, then splits the result into
+ * the spectrum of the N real samples, which is what arm_rfft_fast_f32
+ * does too.
+ */
+template <uint16_t N>
+class RealFft {
+
+    static_assert(N >= 8 && (N & (N - 1)) == 0, "FFT size must be a power of two");
+
+    public:
+
+        void init(void)
+        {
+#if defined(CONFIG_IMU_GYRO_FFT_CMSIS_DSP)
+            arm_rfft_fast_init_f32(&_instance, N);
+#else
+            for (uint16_t k=0; k<M; ++k) {
+                const float angle = 2 * (float)M_PI * k / N;
+                _cos[k] = cosf(angle);
+                _sin[k] = sinf(angle);
+            }
+
+            for (uint16_t k=0; k<M; ++k) {
+                uint16_t reversed = 0;
+                for (uint16_t bit=1, rbit=M>>1; bit<M; bit<<=1, rbit>>=1) {
+                    if (k & bit) {
+                        reversed |= rbit;
+                    }
+                }
+                _reversed[k] = reversed;
+            }
+#endif
+        }
+
+        // Squared magnitudes of bins 0 to N/2-1; the input is overwritten
+        void powerSpectrum(float in[N], float power[N/2])
+        {
+            auto out = _out;
+
+#if defined(CONFIG_IMU_GYRO_FFT_CMSIS_DSP)
+            arm_rfft_fast_f32(&_instance, in, out, 0);
+#else
+            transform(in, out);
+#endif
+
+            power[0] = out[0] * out[0];
+
+            for (uint16_t k=1; k<M; ++k) {
+                power[k] = out[2*k] * out[2*k] + out[2*k+1] * out[2*k+1];
+            }
+        }
+
+    private:
+
+        static const uint16_t M = N / 2;
+
+        // A member rather than a local, to spare the caller's stack
+        float _out[N];
+
+#if defined(CONFIG_IMU_GYRO_FFT_CMSIS_DSP)
+
+        arm_rfft_fast_instance_f32 _instance;
+
+#else
+
+        // Twiddle factors exp(-2 pi i k / N) are cos - i sin
+        float _cos[M];
+        float _sin[M];
+
+        uint16_t _reversed[M];
+
+        void transform(float in[N], float out[N])
+        {
+            // Samples 2n and 2n+1 as the real and imaginary parts of z[n]
+            for (uint16_t k=0; k<M; ++k) {
+                const auto j = _reversed[k];
+                out[2*j] = in[2*k];
+                out[2*j+1] = in[2*k+1];
+            }
+
+            // Radix-2 butterflies; an M-point twiddle is every other one of
+            // the N-point table
+            for (uint16_t size=2; size<=M; size<<=1) {
+
+                const uint16_t half = size >> 1;
+                const uint16_t stride = N / size;
+
+                for (uint16_t start=0; start<M; start+=size) {
+                    for (uint16_t k=0; k<half; ++k) {
+
+                        const float wr = _cos[k * stride];
+                        const float wi = -_sin[k * stride];
+
+                        float * a = &out[2*(start + k)];
+                        float * b = &out[2*(start + k + half)];
+
+                        const float tr = b[0] * wr - b[1] * wi;
+                        const float ti = b[0] * wi + b[1] * wr;
+
+                        b[0] = a[0] - tr;
+                        b[1] = a[1] - ti;
+                        a[0] += tr;
+                        a[1] += ti;
+                    }
+                }
+            }
+
+            // X[k] = E[k] + W^k O[k], where E and O are the spectra of the
+            // even and odd samples, recovered from Z[k] and Z[M-k].  Bins k
+            // and M-k are done together, since each needs the other.
+            const float z0r = out[0];
+            const float z0i = out[1];
+
+            out[0] = z0r + z0i;
+            out[1] = z0r - z0i;
+
+            for (uint16_t k=1; k<=M/2; ++k) {
+
+                const float zr = out[2*k];
+                const float zi = out[2*k+1];
+                const float cr = out[2*(M-k)];
+                const float ci = out[2*(M-k)+1];
+
+                split(k, zr, zi, cr, ci, out[2*k], out[2*k+1]);
+
+                if (k != M - k) {
+                    split(M - k, cr, ci, zr, zi,
+                            out[2*(M-k)], out[2*(M-k)+1]);
+                }
+            }
+        }
+
+        // Bin k from Z[k] and Z[M-k]
+        void split(
+                const uint16_t k,
+                const float zr, const float zi,
+                const float cr, const float ci,
+                float & xr, float & xi) const
+        {
+            const float er = (zr + cr) / 2;
+            const float ei = (zi - ci) / 2;
+            const float or_ = (zi + ci) / 2;
+            const float oi = (cr - zr) / 2;
+
+            const float wr = _cos[k];
+            const float wi = -_sin[k];
+
+            xr = er + or_ * wr - oi * wi;
+            xi = ei + or_ * wi + oi * wr;
+        }
+
+#endif
+};
@@ -42,6 +42,8 @@
 #include <platform/platform.h>
 
 #include <console.h>
+#include <dshot.hpp>
+#include <thrust_table.hpp>
 #include <nvicconf.h>
 
 #include "cf_motors.h"
@@ -118,11 +120,6 @@
 #define MOTORS_BL_POLARITY           TIM_OCPolarity_Low
 #define MOTORS_TIM_VALUE_FOR_0       (uint16_t)(MOTORS_BL_PWM_PERIOD * 0.37425)
 #define MOTORS_TIM_VALUE_FOR_1       (uint16_t)(MOTORS_BL_PWM_PERIOD * 0.7485)
-#define DSHOT_FRAME_SIZE             16
-#define DSHOT_DMA_BUFFER_SIZE        17 /* With zero ending  */
-#define DSHOT_MIN_THROTTLE           48
-#define DSHOT_MAX_THROTTLE           2047
-#define DSHOT_RANGE                  (DSHOT_MAX_THROTTLE - DSHOT_MIN_THROTTLE)
 
 #define MOTORS_BL_PWM_CNT_FOR_HIGH   1
 #else
@@ -153,10 +150,15 @@ uint16_t motorPowerSet[] = {0, 0, 0, 0}; // user-requested PWM signals (override
 // Shared with logger
 uint32_t motor_ratios[] = {0, 0, 0, 0};  // actual PWM signals
 
+#ifdef CONFIG_ENABLE_THRUST_BAT_COMPENSATED
+// Written by the power monitor, read by the core loop
+static ThrustTable thrustTable;
+#endif
+
 #ifdef CONFIG_MOTORS_ESC_PROTOCOL_DSHOT
 static DMA_InitTypeDef DMA_InitStructureShare;
 // Memory buffer for DSHOT bits
-static uint32_t dshotDmaBuffer[NBR_OF_MOTORS][DSHOT_DMA_BUFFER_SIZE];
+static uint32_t dshotDmaBuffer[NBR_OF_MOTORS][Dshot::BUFFER_SIZE];
 static void motorsDshotDMASetup();
 static volatile uint32_t dmaWait;
 #endif
@@ -449,7 +451,7 @@ static void motorsDshotDMASetup()
     DMA_InitStructureShare.DMA_MemoryInc = DMA_MemoryInc_Enable;
     DMA_InitStructureShare.DMA_MemoryBurst = DMA_MemoryBurst_Single;
     DMA_InitStructureShare.DMA_MemoryDataSize = DMA_MemoryDataSize_Word;
-    DMA_InitStructureShare.DMA_BufferSize = DSHOT_DMA_BUFFER_SIZE;
+    DMA_InitStructureShare.DMA_BufferSize = Dshot::BUFFER_SIZE;
     DMA_InitStructureShare.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
     DMA_InitStructureShare.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word;
     DMA_InitStructureShare.DMA_PeripheralBurst = DMA_PeripheralBurst_Single;
@@ -476,47 +478,17 @@ static void motorsDshotDMASetup()
 
 static void motorsPrepareDshot(uint32_t id, uint16_t ratio)
 {
-    uint16_t dshotBits;
-    bool dshot_telemetry = false;
-    uint16_t dshotRatio;
-
     ASSERT(id < NBR_OF_MOTORS);
 
-    // Scale 16 -> 11 bits
-    dshotRatio = (ratio >> 5);
-    // Remove command area of DSHOT
-    if (dshotRatio < (DSHOT_MIN_THROTTLE - 1))
-    {
-        dshotRatio = 0;
-    }
-
-    dshotBits = (dshotRatio << 1) | (dshot_telemetry ? 1 : 0);
-
-    // compute checksum
-    unsigned cs = 0;
-    unsigned csData = dshotBits;
-
-    for (int i = 0; i < 3; i++)
-    {
-        cs ^=  csData; // xor data by nibbles
-        csData >>= 4;
-    }
-
-    cs &= 0xf;
-    dshotBits = (dshotBits << 4) | cs;
-
-    for(int i = 0; i < DSHOT_FRAME_SIZE; i++)
-    {
-        dshotDmaBuffer[id][i] = (dshotBits & 0x8000) ? MOTORS_TIM_VALUE_FOR_1 : MOTORS_TIM_VALUE_FOR_0;
-        dshotBits <<= 1;
-    }
-    dshotDmaBuffer[id][16] = 0; // Set to 0 gives low output afterwards
-
-    // Wait for DMA to be free. Can happen at startup but doesn't seem to wait afterwards.
+    // Wait for the previous burst to finish with the buffer.  At 1kHz it
+    // has long finished, except at startup.
     while(DMA_GetCmdStatus(motorMap[id]->DMA_stream) != DISABLE)
     {
         dmaWait++;
     }
+
+    Dshot::expand(Dshot::frame(Dshot::ratioToThrottle(ratio)),
+            MOTORS_TIM_VALUE_FOR_1, MOTORS_TIM_VALUE_FOR_0, dshotDmaBuffer[id]);
 }
 
 /**
@@ -527,8 +499,8 @@ static void motorsPrepareDshot(uint32_t id, uint16_t ratio)
 void motorsBurstDshot()
 {
 
-    motorMap[0]->DMA_stream->NDTR = DSHOT_DMA_BUFFER_SIZE;
-    motorMap[1]->DMA_stream->NDTR = DSHOT_DMA_BUFFER_SIZE;
+    motorMap[0]->DMA_stream->NDTR = Dshot::BUFFER_SIZE;
+    motorMap[1]->DMA_stream->NDTR = Dshot::BUFFER_SIZE;
     /* Enable TIM DMA Requests M1*/
     TIM_DMACmd(motorMap[0]->tim, motorMap[0]->TIM_DMASource, ENABLE);
     DMA_ITConfig(motorMap[0]->DMA_stream, DMA_IT_TC, ENABLE);
@@ -536,14 +508,14 @@ void motorsBurstDshot()
     /* Enable DMA TIM Stream */
     DMA_Cmd(motorMap[0]->DMA_stream, ENABLE);
 
-    motorMap[2]->DMA_stream->NDTR = DSHOT_DMA_BUFFER_SIZE;
+    motorMap[2]->DMA_stream->NDTR = Dshot::BUFFER_SIZE;
     /* Enable TIM DMA Requests M3*/
     TIM_DMACmd(motorMap[2]->tim, motorMap[2]->TIM_DMASource, ENABLE);
     DMA_ITConfig(motorMap[2]->DMA_stream, DMA_IT_TC, ENABLE);
     /* Enable DMA TIM Stream */
     DMA_Cmd(motorMap[2]->DMA_stream, ENABLE);
 
-    motorMap[3]->DMA_stream->NDTR = DSHOT_DMA_BUFFER_SIZE;
+    motorMap[3]->DMA_stream->NDTR = Dshot::BUFFER_SIZE;
     /* Enable TIM DMA Requests M4*/
     TIM_DMACmd(motorMap[3]->tim, motorMap[3]->TIM_DMASource, ENABLE);
     DMA_ITConfig(motorMap[3]->DMA_stream, DMA_IT_TC, ENABLE);
@@ -595,6 +567,12 @@ static void setRatio(uint32_t id, uint16_t ithrust)
 
         uint16_t ratio = ithrust;
 
+#ifdef CONFIG_ENABLE_THRUST_BAT_COMPENSATED
+        if (motorMap[id]->drvType == BRUSHED) {
+            ratio = thrustTable.apply(ithrust);
+        }
+#endif
+
         if (motorSetEnable) {
             ratio = motorPowerSet[id];
         }
@@ -628,77 +606,13 @@ static void setRatio(uint32_t id, uint16_t ithrust)
 //////////////////////////////////////////////////////////////////////////////
 
 
-// We have data that maps PWM to thrust at different supply voltage levels.
-// However, it is not the PWM that drives the motors but the voltage and
-// amps (= power). With the PWM it is possible to simulate different
-// voltage levels. The assumption is that the voltage used will be an
-// procentage of the supply voltage, we assume that 50% PWM will result in
-// 50% voltage.
-//
-//  Thrust (g)    Supply Voltage    PWM (%)     Voltage needed
-//  0.0           4.01              0           0
-//  1.6           3.98              6.25        0.24875
-//  4.8           3.95              12.25       0.49375
-//  7.9           3.82              18.75       0.735
-//  10.9          3.88              25          0.97
-//  13.9          3.84              31.25       1.2
-//  17.3          3.80              37.5        1.425
-//  21.0          3.76              43.25       1.6262
-//  24.4          3.71              50          1.855
-//  28.6          3.67              56.25       2.06438
-//  32.8          3.65              62.5        2.28125
-//  37.3          3.62              68.75       2.48875
-//  41.7          3.56              75          2.67
-//  46.0          3.48              81.25       2.8275
-//  51.9          3.40              87.5        2.975
-//  57.9          3.30              93.75       3.09375
-//
-// To get Voltage needed from wanted thrust we can get the quadratic
-// polyfit coefficients using GNU octave:
-//
-// thrust = [0.0 1.6 4.8 7.9 10.9 13.9 17.3 21.0 ...
-//           24.4 28.6 32.8 37.3 41.7 46.0 51.9 57.9]
-//
-// volts  = [0.0 0.24875 0.49375 0.735 0.97 1.2 1.425 1.6262 1.855 ...
-//           2.064375 2.28125 2.48875 2.67 2.8275 2.975 3.09375]
-//
-// p = polyfit(thrust, volts, 2)
-//
-// => p = -0.00062390   0.08835522   0.06865956
-//
-// We will not use the constant term, since we want zero thrust to equal
-// zero PWM.
-//
-// And to get the PWM as a percentage we would need to divide the
-// Voltage needed with the Supply voltage.
-float motorsCompensateBatteryVoltage(uint32_t id, float iThrust, float supplyVoltage)
+void motorsSetSupplyVoltage(const uint16_t millivolts)
 {
 #ifdef CONFIG_ENABLE_THRUST_BAT_COMPENSATED
-    ASSERT(id < NBR_OF_MOTORS);
-
-    if (motorMap[id]->drvType == BRUSHED)
-    {
-        /*
-         * A LiPo battery is supposed to be 4.2V charged, 3.7V mid-charge and 3V
-         * discharged.
-         *
-         * A suitable sanity check for disabling the voltage compensation would be
-         * under 2V. That would suggest a damaged battery. This protects against
-         * rushing the motors on bugs and invalid voltage levels.
-         */
-        if (supplyVoltage < 2.0f)
-        {
-            return iThrust;
-        }
-
-        float thrust = (iThrust / 65536.0f) * 60;
-        float volts = -0.0006239f * thrust * thrust + 0.088f * thrust;
-        float ratio = volts / supplyVoltage;
-        return UINT16_MAX * ratio;
-    }
+    thrustTable.setSupplyVoltage(millivolts);
+#else
+    (void)millivolts;
 #endif
-
-    return iThrust;
 }
 
 int motorsGetRatio(uint32_t id)
@@ -826,10 +740,17 @@ bool motorsTest(void)
     return didInit;
 }
 
+// With DShot, all four frames are prepared and then sent in one burst
 void motorsSetRatios(const uint16_t ratios[])
 {
+#ifdef CONFIG_ENABLE_THRUST_BAT_COMPENSATED
+  thrustTable.refresh();
+#endif
+
   setRatio(MOTOR_M1, ratios[0]);
   setRatio(MOTOR_M2, ratios[1]);
   setRatio(MOTOR_M3, ratios[2]);
   setRatio(MOTOR_M4, ratios[3]);
+
+  motorsCheckDshot();
 }
@@ -0,0 +1,127 @@
+/**
+ * Pre-integration of gyro and accelerometer samples into delta-angle and
+ * delta-velocity packets for the estimator
+ *
+ * Copyright (C) 2024 Simon D. Levy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string.h>
+
+#include <datatypes.h>
+#include <m_pi.h>
+
+/**
+ * Each sample is taken as constant over the time since the previous one.
+ * Summing the delta angles alone would ignore that rotations don't
+ * commute, so we add the coning term 1/2 (alpha x dtheta), with alpha the
+ * angle accumulated before the sample (the first-order term of the Bortz
+ * equation).  Delta velocities are rotated back into the body frame at
+ * the start of the interval, through the angle accumulated to the middle of
+ * each sample, which is where the EKF takes its mean acceleration to act.
+ */
+class ImuPreintegrator {
+
+    public:
+
+        // Start a new interval at this sample time
+        void reset(const uint64_t timestampUsec)
+        {
+            memset(&_delta, 0, sizeof(_delta));
+            _delta.timestamp = timestampUsec;
+            _count = 0;
+        }
+
+        // Gyro in deg/sec, accel in Gs
+        void integrate(
+                const Axis3f & gyro,
+                const Axis3f & accel,
+                const uint64_t timestampUsec)
+        {
+            const float dt = (timestampUsec - _delta.timestamp) / 1e6f;
+
+            _delta.timestamp = timestampUsec;
+            _delta.gyro = gyro;
+
+            if (dt <= 0 || dt > MAX_SAMPLE_DT) {
+                return;
+            }
+
+            const float dtheta[3] = {
+                gyro.x * DEG_TO_RAD * dt,
+                gyro.y * DEG_TO_RAD * dt,
+                gyro.z * DEG_TO_RAD * dt
+            };
+
+            const float dv[3] = {
+                accel.x * GS_TO_MSS * dt,
+                accel.y * GS_TO_MSS * dt,
+                accel.z * GS_TO_MSS * dt
+            };
+
+            auto & alpha = _delta.deltaAngle.axis;
+
+            const float mid[3] = {
+                alpha[0] + dtheta[0] / 2,
+                alpha[1] + dtheta[1] / 2,
+                alpha[2] + dtheta[2] / 2
+            };
+
+            auto & v = _delta.deltaVelocity.axis;
+
+            v[0] += dv[0] + mid[1] * dv[2] - mid[2] * dv[1];
+            v[1] += dv[1] + mid[2] * dv[0] - mid[0] * dv[2];
+            v[2] += dv[2] + mid[0] * dv[1] - mid[1] * dv[0];
+
+            const float coning[3] = {
+                (alpha[1] * dtheta[2] - alpha[2] * dtheta[1]) / 2,
+                (alpha[2] * dtheta[0] - alpha[0] * dtheta[2]) / 2,
+                (alpha[0] * dtheta[1] - alpha[1] * dtheta[0]) / 2
+            };
+
+            alpha[0] += dtheta[0] + coning[0];
+            alpha[1] += dtheta[1] + coning[1];
+            alpha[2] += dtheta[2] + coning[2];
+
+            _delta.dt += dt;
+
+            _count++;
+        }
+
+        uint32_t count(void) const
+        {
+            return _count;
+        }
+
+        // Hands over the interval so far and starts the next one
+        void take(imuDelta_t & delta)
+        {
+            delta = _delta;
+            reset(_delta.timestamp);
+        }
+
+    private:
+
+        static constexpr float DEG_TO_RAD = M_PI / 180;
+        static constexpr float GS_TO_MSS = 9.81;
+
+        // Gaps longer than this (startup, a stalled task) aren't integrated
+        static constexpr float MAX_SAMPLE_DT = 0.1;
+
+        imuDelta_t _delta;
+
+        uint32_t _count;
+};
@@ -0,0 +1,152 @@
+/**
+ * Rolling latency statistics from a fixed-bin histogram
+ *
+ * Copyright (C) 2024 Simon D. Levy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <console.h>
+
+/**
+ * Latencies are binned over a window of WINDOW samples; at the end of each
+ * window the statistics are computed and held for the logger until the
+ * next one completes.  Recording is O(1), with no floating point, so it can
+ * sit in the core loop.
+ *
+ * The bins are log-spaced, so that sub-millisecond IMU latencies and range
+ * latencies of tens of milliseconds share one histogram: BIN_USEC wide up
+ * to 8 * BIN_USEC, then eight bins per doubling up to MAX_USEC.  The 99th
+ * percentile is the upper edge of its bin, so it errs high by less than
+ * BIN_USEC or an eighth; in the last bin, which takes all above, it is
+ * the maximum.
+ */
+class LatencyHistogram {
+
+    public:
+
+        static const uint32_t BIN_USEC = 64;
+        static const uint8_t SUBBINS = 8; // per doubling
+        static const uint8_t NBINS = 72;  // the last one takes all above
+
+        static const uint32_t MAX_USEC = 122880; // upper edge of bin NBINS-2
+
+        static const uint32_t WINDOW = 1000;
+
+        // Shared with logger: usec, over the last complete window
+        uint32_t min;
+        uint32_t mean;
+        uint32_t max;
+        uint32_t p99;
+
+        void record(const uint32_t usec)
+        {
+            _bins[bin(usec)]++;
+
+            _sum += usec;
+            _min = _count == 0 || usec < _min ? usec : _min;
+            _max = usec > _max ? usec : _max;
+
+            if (++_count == WINDOW) {
+                publish();
+            }
+        }
+
+        // Prints the last complete window, with its non-empty bins
+        void dump(const char * name) const
+        {
+            consolePrintf("%s latency (usec): min=%lu mean=%lu max=%lu p99=%lu\n",
+                    name, min, mean, max, p99);
+
+            for (uint8_t k=0; k<NBINS; ++k) {
+                if (_lastBins[k] > 0) {
+                    consolePrintf("  %6lu-%6lu: %lu\n",
+                            (unsigned long)(k == 0 ? 0 : upperEdge(k - 1)),
+                            (unsigned long)upperEdge(k),
+                            (unsigned long)_lastBins[k]);
+                }
+            }
+        }
+
+        static uint8_t bin(const uint32_t usec)
+        {
+            if (usec >= MAX_USEC) {
+                return NBINS - 1;
+            }
+
+            const auto units = usec / BIN_USEC;
+
+            if (units < SUBBINS) {
+                return units;
+            }
+
+            // The doubling it falls in, and which eighth of that
+            const uint8_t msb = 31 - __builtin_clz(units);
+
+            return (msb - 2) * SUBBINS + ((units >> (msb - 3)) & (SUBBINS - 1));
+        }
+
+        // Exclusive upper edge of a bin, in usec; the last one has none
+        static constexpr uint32_t upperEdge(const uint8_t k)
+        {
+            return k < SUBBINS ?
+                (k + 1) * BIN_USEC :
+                ((SUBBINS + 1 + k % SUBBINS) << (k / SUBBINS - 1)) * BIN_USEC;
+        }
+
+    private:
+
+        uint16_t _bins[NBINS];
+        uint16_t _lastBins[NBINS];
+
+        uint32_t _count;
+        uint64_t _sum;
+        uint32_t _min;
+        uint32_t _max;
+
+        void publish(void)
+        {
+            min = _min;
+            max = _max;
+            mean = _sum / _count;
+
+            const auto target = (_count * 99 + 99) / 100;
+
+            uint32_t cumulative = 0;
+            uint8_t k = 0;
+            for (; k<NBINS-1; ++k) {
+                cumulative += _bins[k];
+                if (cumulative >= target) {
+                    break;
+                }
+            }
+
+            const auto edge = upperEdge(k);
+            p99 = k == NBINS - 1 || edge > _max ? _max : edge;
+
+            memcpy(_lastBins, _bins, sizeof(_lastBins));
+            memset(_bins, 0, sizeof(_bins));
+
+            _count = 0;
+            _sum = 0;
+            _max = 0;
+        }
+};
+
+static_assert(LatencyHistogram::upperEdge(LatencyHistogram::NBINS - 2) ==
+        LatencyHistogram::MAX_USEC, "latency histogram range");
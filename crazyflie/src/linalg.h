@@ -3,16 +3,11 @@
 #include <stdio.h>
 #include <stdint.h>
 
-static const uint8_t N =
-#ifdef _TEST
-3
-#else
-7
-#endif
-;
-
+// Matrix and vector sizes are template parameters, so that filters of
+// different dimensions can share these routines
 
-static void transpose(const float a[N][N], float at[N][N])
+template <uint8_t N>
+static void transpose(const float (&a)[N][N], float (&at)[N][N])
 {
     for (uint8_t i=0; i<N; ++i) {
         for (uint8_t j=0; j<N; ++j) {
@@ -23,7 +18,8 @@ static void transpose(const float a[N][N], float at[N][N])
     }
 }
 
-static float dot(const float x[N], const float y[N]) 
+template <uint8_t N>
+static float dot(const float (&x)[N], const float (&y)[N]) 
 {
     float d = 0;
 
@@ -34,7 +30,8 @@ static float dot(const float x[N], const float y[N])
     return d;
 }
 
-static float dot(const float a[N][N], const float b[N][N], 
+template <uint8_t N>
+static float dot(const float (&a)[N][N], const float (&b)[N][N], 
         const uint8_t i, const uint8_t j)
 {
     float d = 0;
@@ -47,7 +44,9 @@ static float dot(const float a[N][N], const float b[N][N],
 }
 
 // Matrix * Matrix
-static void multiply(const float a[N][N], const float b[N][N], float c[N][N])
+template <uint8_t N>
+static void multiply(
+        const float (&a)[N][N], const float (&b)[N][N], float (&c)[N][N])
 {
     for (uint8_t i=0; i<N; i++) {
 
@@ -59,7 +58,8 @@ static void multiply(const float a[N][N], const float b[N][N], float c[N][N])
 }
 
 // Matrix * Vector
-static void multiply(const float a[N][N], const float x[N], float y[N])
+template <uint8_t N>
+static void multiply(const float (&a)[N][N], const float (&x)[N], float (&y)[N])
 {
     for (uint8_t i=0; i<N; i++) {
         y[i] = 0;
@@ -70,7 +70,8 @@ static void multiply(const float a[N][N], const float x[N], float y[N])
 }
 
 // Outer product
-static void multiply(const float x[N], const float y[N], float a[N][N])
+template <uint8_t N>
+static void multiply(const float (&x)[N], const float (&y)[N], float (&a)[N][N])
 {
     for (uint8_t i=0; i<N; i++) {
         for (uint8_t j=0; j<N; j++) {
@@ -81,7 +82,8 @@ static void multiply(const float x[N], const float y[N], float a[N][N])
 
 #ifdef _TEST
 
-static void show(const float a[N][N])
+template <uint8_t N>
+static void show(const float (&a)[N][N])
 {
     for (uint8_t i=0; i<N; ++i) {
 
@@ -93,7 +95,8 @@ static void show(const float a[N][N])
     }
 }
 
-static void show(const float x[N])
+template <uint8_t N>
+static void show(const float (&x)[N])
 {
     for (uint8_t i=0; i<N; ++i) {
         printf("%3.0f ", (double)x[i]);
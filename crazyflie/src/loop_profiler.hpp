@@ -0,0 +1,122 @@
+/**
+ * Per-stage cycle counts for the core loop, from the Cortex-M DWT counter
+ *
+ * Copyright (C) 2024 Simon D. Levy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <autoconf.h>
+
+#if defined(CONFIG_DEBUG_CORE_LOOP_PROFILING)
+#include <stm32fxxx.h>
+#endif
+
+/**
+ * Each call to mark() charges the cycles since the previous one to a stage.
+ * A stage keeps a running mean (an exponential average over about sixteen
+ * loops) and its maximum.  The stages of the slowest loop, not counting
+ * the wait for the IMU, are kept together as the worst case, so that a
+ * spike can be traced to the stage that caused it.
+ *
+ * Without CONFIG_DEBUG_CORE_LOOP_PROFILING, the calls compile to nothing.
+ */
+class LoopProfiler {
+
+    public:
+
+        // The wait also covers the bookkeeping after the motor output
+        typedef enum {
+            STAGE_WAIT,
+            STAGE_ACQUIRE,
+            STAGE_STATE,
+            STAGE_DEMANDS,
+            STAGE_SAFETY,
+            STAGE_COPILOT,
+            STAGE_SCALE,
+            STAGE_MOTORS,
+            STAGE_COUNT
+        } stage_e;
+
+#if defined(CONFIG_DEBUG_CORE_LOOP_PROFILING)
+
+        // Shared with logger, in CPU cycles
+        uint32_t mean[STAGE_COUNT];
+        uint32_t max[STAGE_COUNT];
+        uint32_t worst[STAGE_COUNT];
+        uint32_t worstTotal;
+
+        void begin(void)
+        {
+            CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+            DWT->CYCCNT = 0;
+            DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+            _last = DWT->CYCCNT;
+        }
+
+        // Call at the top of each loop, before the first stage
+        void startLoop(void)
+        {
+            const auto total = _busy;
+
+            if (total > worstTotal) {
+                worstTotal = total;
+                memcpy(worst, _current, sizeof(worst));
+            }
+
+            memset(_current, 0, sizeof(_current));
+            _busy = 0;
+        }
+
+        void mark(const stage_e stage)
+        {
+            const uint32_t now = DWT->CYCCNT;
+            const auto cycles = now - _last; // wraps correctly
+            _last = now;
+
+            _current[stage] = cycles;
+
+            if (stage != STAGE_WAIT) {
+                _busy += cycles;
+            }
+
+            // Scaled by 16, so the average keeps its fractional bits
+            _meanScaled[stage] += cycles - (_meanScaled[stage] >> 4);
+            mean[stage] = _meanScaled[stage] >> 4;
+
+            max[stage] = cycles > max[stage] ? cycles : max[stage];
+        }
+
+    private:
+
+        uint32_t _last;
+        uint32_t _busy;
+        uint32_t _current[STAGE_COUNT];
+        uint32_t _meanScaled[STAGE_COUNT];
+
+#else
+
+        void begin(void) { }
+
+        void startLoop(void) { }
+
+        void mark(const stage_e stage) { (void)stage; }
+
+#endif
+};
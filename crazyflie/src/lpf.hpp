@@ -21,7 +21,9 @@
 #include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "datatypes.h"
 #include "m_pi.h"
 
 class Lpf {
@@ -274,3 +276,109 @@ class Lpf {
         }
 
 }; // class Lpf
+
+/**
+ * Butterworth low-pass filtering of three axes at once, as a cascade of
+ * SECTIONS biquads (order 2 * SECTIONS).  The coefficients of each section
+ * are shared by the axes, and each delay line holds all three axes side by
+ * side, so the inner loops run over the axes with no branches and unroll
+ * into straight-line FPU code.
+ *
+ * The sections are direct-form I: their delay lines hold past inputs and
+ * outputs rather than internal states, so a new cutoff takes effect on the
+ * next sample without a jump in the output.  The output history of one
+ * section is the input history of the next, so a cascade needs only
+ * SECTIONS + 1 delay lines.
+ */
+template <uint8_t SECTIONS=1>
+class Lpf3 {
+
+    static_assert(SECTIONS >= 1, "Lpf3 needs at least one section");
+
+    public:
+
+        void init(const float sample_freq, const float cutoff_freq)
+        {
+            memset(_z1, 0, sizeof(_z1));
+            memset(_z2, 0, sizeof(_z2));
+
+            _sample_freq = sample_freq;
+
+            setCutoffFreq(cutoff_freq);
+        }
+
+        // Can be called at any time; a cutoff of zero passes samples through
+        void setCutoffFreq(const float cutoff_freq)
+        {
+            const float k = tanf((float)M_PI * cutoff_freq / _sample_freq);
+
+            for (uint8_t s=0; s<SECTIONS; ++s) {
+
+                if (cutoff_freq <= 0) {
+                    _b0[s] = 1;
+                    _b1[s] = _b2[s] = _a1[s] = _a2[s] = 0;
+                    continue;
+                }
+
+                // Butterworth poles, a pair per section
+                const float q = 1 / (2 * cosf(
+                            (2 * s + 1) * (float)M_PI / (4 * SECTIONS)));
+
+                const float poly = k * k + k / q + 1;
+
+                _b0[s] = k * k / poly;
+                _b1[s] = 2 * _b0[s];
+                _b2[s] = _b0[s];
+                _a1[s] = 2 * (k * k - 1) / poly;
+                _a2[s] = (k * k - k / q + 1) / poly;
+            }
+        }
+
+        void apply(Axis3f & sample)
+        {
+            float x[3] = { sample.x, sample.y, sample.z };
+
+            for (uint8_t s=0; s<SECTIONS; ++s) {
+
+                float y[3];
+
+                for (uint8_t i=0; i<3; ++i) {
+                    y[i] = _b0[s] * x[i] +
+                        _b1[s] * _z1[s][i] + _b2[s] * _z2[s][i] -
+                        _a1[s] * _z1[s+1][i] - _a2[s] * _z2[s+1][i];
+                }
+
+                for (uint8_t i=0; i<3; ++i) {
+                    _z2[s][i] = _z1[s][i];
+                    _z1[s][i] = x[i];
+                    x[i] = y[i];
+                }
+            }
+
+            for (uint8_t i=0; i<3; ++i) {
+                _z2[SECTIONS][i] = _z1[SECTIONS][i];
+                _z1[SECTIONS][i] = x[i];
+            }
+
+            sample.x = x[0];
+            sample.y = x[1];
+            sample.z = x[2];
+        }
+
+    private:
+
+        float _sample_freq;
+
+        // Coefficients, one set per section
+        float _b0[SECTIONS];
+        float _b1[SECTIONS];
+        float _b2[SECTIONS];
+        float _a1[SECTIONS];
+        float _a2[SECTIONS];
+
+        // Delay lines, one and two samples back: the filter input, then the
+        // output of each section
+        float _z1[SECTIONS+1][3];
+        float _z2[SECTIONS+1][3];
+
+}; // class Lpf3
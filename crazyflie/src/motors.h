@@ -34,6 +34,7 @@ int   motorsGetRatio(uint32_t id);
 void  motorsInit(void);
 bool  motorsTest(void);
 void  motorsSetRatios(const uint16_t ratios[]);
+void  motorsSetSupplyVoltage(const uint16_t millivolts);
 
 #ifdef __cplusplus
 extern "C" {
@@ -809,6 +809,18 @@ extern uint16_t system_echoDelay;
     PARAM_ADD_CORE(PARAM_UINT8, taskDump, &sysload_triggerDump)
 PARAM_GROUP_STOP(stabilizer)
 
+static void dumpLatencies(void)
+{
+    if (coreTask.doLatencyDump) {
+        coreTask.dumpLatencies();
+        coreTask.doLatencyDump = 0;
+    }
+}
+
+    PARAM_GROUP_START(latency)
+    PARAM_ADD_WITH_CALLBACK(PARAM_UINT8, dump, &coreTask.doLatencyDump, dumpLatencies)
+PARAM_GROUP_STOP(latency)
+
     //////////////////////////////////////////////////////////////////////////////
 
 static void printStats(void)
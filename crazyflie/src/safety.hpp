@@ -31,6 +31,8 @@ class Safety {
         uint8_t paramEmergencyStop;
         int8_t deprecatedArmParam;
 
+        static const Clock::rate_t CLOCK_RATE = Clock::RATE_25_HZ;
+
         void init(void)
         {
             bzero(stateTransitions, sizeof(stateTransitions));
@@ -214,16 +216,9 @@ class Safety {
             return true;
         }
 
-        void update(
-                const sensorData_t & sensors, 
-                const uint32_t coreStep,
-                const uint32_t timestamp, 
-                demands_t & demands)
+        // Called by the core loop at CLOCK_RATE
+        void update(const sensorData_t & sensors, const uint32_t timestamp)
         { 
-            if (!Clock::rateDoExecute(CLOCK_RATE, coreStep)) {
-                return;
-            }
-
             const auto currentTick = xTaskGetTickCount();
 
             const auto conditions = 
@@ -243,7 +238,11 @@ class Safety {
                 doinfodump = 0;
                 infoDump();
             }
+        }
 
+        // Called by the core loop on each new set of demands
+        void modifyDemands(demands_t & demands) const
+        {
             // Modify the demands to handle exceptional conditions
 
             switch(state){
@@ -299,8 +298,6 @@ class Safety {
             conditionCombinerNever,
         } conditionCombiner_t;
 
-        static const Clock::rate_t CLOCK_RATE = Clock::RATE_25_HZ;
-
         // Condition bit definitions
         static const uint32_t CB_NONE = 0;
         static const uint32_t CB_ARMED = 1 << conditionArmed;
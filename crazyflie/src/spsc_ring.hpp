@@ -0,0 +1,79 @@
+/**
+ * Lock-free single-producer/single-consumer ring buffer
+ *
+ * Copyright (C) 2024 Simon D. Levy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * One task (or interrupt) pushes and one other task pops, with no locking
+ * and no kernel calls.  The producer owns _head and the consumer owns
+ * _tail; each publishes its index with release semantics after touching
+ * the slot, so the other side never sees a slot before its contents.
+ *
+ * SIZE must be a power of two; the indices run freely and are masked on
+ * use, so all SIZE slots are usable.
+ */
+template <typename T, uint16_t SIZE>
+class SpscRing {
+
+    static_assert(SIZE > 0 && (SIZE & (SIZE - 1)) == 0,
+            "ring size must be a power of two");
+
+    public:
+
+        // Returns false, leaving the ring unchanged, if it is full
+        bool push(const T & item)
+        {
+            const auto head = _head;
+
+            if ((uint16_t)(head - __atomic_load_n(&_tail, __ATOMIC_ACQUIRE)) ==
+                    SIZE) {
+                return false;
+            }
+
+            _items[head & (SIZE - 1)] = item;
+
+            __atomic_store_n(&_head, (uint16_t)(head + 1), __ATOMIC_RELEASE);
+
+            return true;
+        }
+
+        // Returns false if the ring is empty
+        bool pop(T & item)
+        {
+            const auto tail = _tail;
+
+            if (__atomic_load_n(&_head, __ATOMIC_ACQUIRE) == tail) {
+                return false;
+            }
+
+            item = _items[tail & (SIZE - 1)];
+
+            __atomic_store_n(&_tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+
+            return true;
+        }
+
+    private:
+
+        T _items[SIZE];
+
+        uint16_t _head;
+        uint16_t _tail;
+};
@@ -63,6 +63,7 @@ Safety safety;
 
 CoreTask coreTask;
 EstimatorTask estimatorTask;
+ImuTask imuTask;
 FlowDeckTask flowDeckTask;
 ZRangerTask zrangerTask;
 
@@ -89,8 +90,6 @@ void debugDemands (const float roll, const float pitch)
 
 // ---------------------------------------------------------------------------
 
-static ImuTask imuTask;
-
 static ConfigBlock configBlock;
 
 typedef enum {
@@ -37,6 +37,9 @@ class FreeRTOSTask {
 
     protected:
 
+        // For notifying the task directly
+        TaskHandle_t _taskHandle;
+
         void begin(
                 const taskfun_t fun,
                 const char * name,
@@ -44,7 +47,7 @@ class FreeRTOSTask {
                 const uint8_t priority
                 )
         {
-            xTaskCreateStatic(
+            _taskHandle = xTaskCreateStatic(
                     fun, 
                     name, 
                     STACKSIZE, 
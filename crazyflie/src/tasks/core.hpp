@@ -20,8 +20,11 @@
 #include <tasks/estimator.hpp>
 #include <tasks/imu.hpp>
 
+#include <arduino/time.h>
 #include <constants.h>
 #include <crossplatform.h>
+#include <latency.hpp>
+#include <loop_profiler.hpp>
 #include <motors.h>
 #include <rateSupervisor.hpp>
 #include <safety.hpp>
@@ -32,6 +35,31 @@ class CoreTask : public FreeRTOSTask {
 
     public:
 
+        // Shared with logger: age of the newest sample of each kind behind
+        // the motor commands, when they are sent
+        LatencyHistogram imuLatency;
+        LatencyHistogram rangeLatency;
+        LatencyHistogram flowLatency;
+
+        // Shared with logger
+        LoopProfiler profiler;
+
+        // Shared with logger: IMU samples the loop never saw
+        uint32_t imuSamplesMissed;
+
+        // Shared with params
+        uint8_t doLatencyDump;
+
+        // Prints the last complete window of each histogram.  Called from
+        // the param task, never from the core loop: it can print a couple
+        // of hundred lines.
+        void dumpLatencies(void) const
+        {
+            imuLatency.dump("IMU");
+            rangeLatency.dump("Range");
+            flowLatency.dump("Flow");
+        }
+
         void setMotors(float m1, float m2, float m3, float m4)
         {
             _uncapped[0] = m1;
@@ -92,6 +120,34 @@ class CoreTask : public FreeRTOSTask {
 
         float _uncapped[4];
 
+        // Rate groups for the work in the loop, given distinct ticks
+        typedef enum {
+            GROUP_PID,
+            GROUP_SAFETY,
+            GROUP_COUNT
+        } group_e;
+
+        static constexpr Clock::rate_t GROUP_RATES[GROUP_COUNT] = {
+            PID_UPDATE_RATE,
+            Safety::CLOCK_RATE
+        };
+
+        static constexpr RateSchedule<GROUP_COUNT> SCHEDULE = 
+            RateSchedule<GROUP_COUNT>(GROUP_RATES);
+
+        static_assert(SCHEDULE.maxLoad() == 1,
+                "rate groups must fall on distinct ticks");
+
+        // A sensor whose newest sample is older than this has stopped (or
+        // was never fitted, as when the deck has no ranger), so its age
+        // says nothing about the loop's latency
+        static const uint32_t STALE_SENSOR_USEC = 100000;
+
+        static_assert(LatencyHistogram::MAX_USEC >= STALE_SENSOR_USEC,
+                "latency histogram must cover every age recorded");
+
+        // Sends all four commands together, once per tick; with DShot
+        // they go out as a single DMA burst
         void runMotors(const float motorvals[4]) 
         {
             const uint16_t motorsPwm[4]  = {
@@ -104,6 +160,34 @@ class CoreTask : public FreeRTOSTask {
             motorsSetRatios(motorsPwm);
         }
 
+        void recordLatencies(const EstimatorTask::sensorTimes_t & times)
+        {
+            const auto nowUsec = micros();
+
+            recordLatency(imuLatency, times.imu, nowUsec);
+            recordLatency(rangeLatency, times.range, nowUsec);
+            recordLatency(flowLatency, times.flow, nowUsec);
+        }
+
+        static void recordLatency(
+                LatencyHistogram & histogram,
+                const uint64_t sensorUsec,
+                const uint64_t nowUsec)
+        {
+            // No samples of this kind yet
+            if (sensorUsec == 0 || sensorUsec > nowUsec) {
+                return;
+            }
+
+            const auto age = nowUsec - sensorUsec;
+
+            if (age > STALE_SENSOR_USEC) {
+                return;
+            }
+
+            histogram.record(age);
+        }
+
         static void runCoreTask(void* obj)
         {
             ((CoreTask *)obj)->run();
@@ -132,29 +216,62 @@ class CoreTask : public FreeRTOSTask {
             consolePrintf("CORE: Starting loop\n");
             rateSupervisor.init(xTaskGetTickCount(), M2T(1000), 997, 1003, 1);
 
-            for (uint32_t step=1; ; step++) {
+            profiler.begin();
+
+            auto schedule = SCHEDULE;
+
+            // When the latest open-loop demands were received
+            uint32_t demandsTimestamp = 0;
+
+            while (true) {
+
+                const auto due = schedule.step();
+
+                profiler.startLoop();
 
                 // The IMU should unlock at 1kHz
                 _imuTask->waitDataReady();
+                profiler.mark(LoopProfiler::STAGE_WAIT);
+
                 sensorData_t sensorData = {};
-                _imuTask->acquire(&sensorData);
+                imuSamplesMissed += _imuTask->acquire(&sensorData);
+                profiler.mark(LoopProfiler::STAGE_ACQUIRE);
 
                 // Get state vector linear positions and velocities and
                 // angles from estimator
-                _estimatorTask->getVehicleState(&stream_vehicleState);
+                EstimatorTask::sensorTimes_t sensorTimes = {};
+                _estimatorTask->getVehicleState(
+                        &stream_vehicleState, &sensorTimes);
+
+                // The estimator takes in gyro samples in batches, so get
+                // the angular velocities directly from the latest one
+                stream_vehicleState.dphi =    sensorData.gyro.x;
+                stream_vehicleState.dtheta = -sensorData.gyro.y; // negate for ENU
+                stream_vehicleState.dpsi =    sensorData.gyro.z;
+
+                profiler.mark(LoopProfiler::STAGE_STATE);
 
                 const auto areMotorsAllowedToRun = _safety->areMotorsAllowedToRun();
 
                 static float _motorvals[4];
 
-                if (Clock::rateDoExecute(PID_UPDATE_RATE, step)) {
+                if (due & (1 << GROUP_SAFETY)) {
+
+                    // Run the safety state machine on the sensor data and
+                    // how recently we heard from the commander
+                    _safety->update(sensorData, demandsTimestamp);
+                    profiler.mark(LoopProfiler::STAGE_SAFETY);
+                }
+
+                if (due & (1 << GROUP_PID)) {
 
-                    uint32_t timestamp = 0;
                     extern bool stream_inFlyingMode;
 
                     // Get open-loop demands in [-1,+1], as well as timestamp
                     // when they received, and whether hover mode is indicated
-                    _openLoopFun(stream_openLoopDemands, timestamp, stream_inFlyingMode);
+                    _openLoopFun(stream_openLoopDemands, demandsTimestamp,
+                            stream_inFlyingMode);
+                    profiler.mark(LoopProfiler::STAGE_DEMANDS);
 
                     /*
                     static uint32_t count;
@@ -164,19 +281,20 @@ class CoreTask : public FreeRTOSTask {
                                 (double)stream_openLoopDemands.pitch);
                     }*/
 
-                    // Use safety algorithm to modify demands based on sensor data
-                    // and open-loop info
-                    _safety->update(sensorData, step, timestamp, stream_openLoopDemands);
+                    // Use safety state to modify demands
+                    _safety->modifyDemands(stream_openLoopDemands);
 
                     // Run Haskell Copilot
                     extern void copilot_step_core(void);
                     copilot_step_core();
+                    profiler.mark(LoopProfiler::STAGE_COPILOT);
 
                     // Cancel PID resetting
                     stream_resetPids = false;
 
                     // Scale motors spins for output
                     scaleMotors(_uncapped, _motorvals);
+                    profiler.mark(LoopProfiler::STAGE_SCALE);
                 }
 
                 if (areMotorsAllowedToRun) {
@@ -184,6 +302,9 @@ class CoreTask : public FreeRTOSTask {
                 } else {
                     motorsStop();
                 }
+                profiler.mark(LoopProfiler::STAGE_MOTORS);
+
+                recordLatencies(sensorTimes);
 
                 if (!rateSupervisor.validate(xTaskGetTickCount())) {
                     static bool rateWarningDisplayed;
@@ -193,8 +314,6 @@ class CoreTask : public FreeRTOSTask {
                         rateWarningDisplayed = true;
                     }
                 }
-
-                // motorsCheckDshot();
             }
         }
 
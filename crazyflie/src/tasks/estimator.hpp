@@ -16,14 +16,16 @@
 
 #pragma once
 
-#include <semphr.h>
+#include <autoconf.h>
 
 #include <clock.hpp>
 #include <crossplatform.h>
 #include <ekf.hpp>
 #include <rateSupervisor.hpp>
 #include <safety.hpp>
+#include <spsc_ring.hpp>
 #include <task.hpp>
+#include <triple_buffer.hpp>
 
 #include <streams.h>
 
@@ -31,179 +33,252 @@ class EstimatorTask : public FreeRTOSTask {
 
     public:
 
+        // Sensor times (usec) of the newest samples behind a state, zero
+        // until the first one arrives
+        typedef struct {
+            uint64_t imu;
+            uint64_t range;
+            uint64_t flow;
+        } sensorTimes_t;
+
         // Shared with params
         bool didResetEstimation;
 
+        // Shared with logger: samples dropped because a ring was full
+        uint32_t imuDrops;
+        uint32_t flowDrops;
+        uint32_t rangeDrops;
+        uint32_t deltaDrops;
+
+        // Shared with logger: vehicle states the core loop read twice, and
+        // ones the estimator replaced before the core loop read them
+        uint32_t stateStaleReads;
+        uint32_t stateOverwrites;
+
         void begin(Safety * safety)
         {
             _safety = safety;
 
-            // Created in the 'empty' state, meaning the semaphore must first be given,
-            // that is it will block in the task until released by the stabilizer loop
-            _runTaskSemaphore = xSemaphoreCreateBinary();
-
-            _dataMutex = xSemaphoreCreateMutexStatic(&_dataMutexBuffer);
-
-            _measurementsQueue = xQueueCreateStatic(
-                    QUEUE_LENGTH, 
-                    QUEUE_ITEM_SIZE,
-                    measurementsQueueStorage,
-                    &measurementsQueueBuffer);
-
             FreeRTOSTask::begin(runEstimatorTask, "estimator", this, 4);
 
             consolePrintf("ESTIMATOR: estimatorTaskStart\n");
 
-            _ekf.initialize();
+            _ekf.initialize(IMU_RATE_MEAN);
         }
 
-        void getVehicleState(vehicleState_t * state)
+        void getVehicleState(vehicleState_t * state, sensorTimes_t * times)
         {
-            // This function is called from the stabilizer loop. It is important that
-            // this call returns as quickly as possible. The dataMutex must only be
-            // locked short periods by the task.
-            xSemaphoreTake(_dataMutex, portMAX_DELAY);
-
-            // Copy the latest state, calculated by the task
-            memcpy(state, &_state, sizeof(vehicleState_t));
-            xSemaphoreGive(_dataMutex);
-
-            xSemaphoreGive(_runTaskSemaphore);
+            // This function is called from the stabilizer loop, so it must
+            // never block: take the latest state the task has published,
+            // or the previous one again if there is nothing newer
+            publishedState_t published = {};
+            stateStaleReads += !_state.read(published);
+
+            memcpy(state, &published.state, sizeof(vehicleState_t));
+            memcpy(times, &published.times, sizeof(sensorTimes_t));
         }
 
-        void enqueueGyro(const Axis3f * gyro, const bool isInInterrupt)
+        // this is slower than the IMU update rate of 1000Hz
+#if defined(CONFIG_ESTIMATOR_KALMAN_PREDICT_RATE)
+        static const uint32_t PREDICT_RATE = CONFIG_ESTIMATOR_KALMAN_PREDICT_RATE;
+#else
+        static const uint32_t PREDICT_RATE = Clock::RATE_100_HZ; 
+#endif
+
+        // The IMU task pre-integrates its samples and sends one delta per
+        // prediction, which then runs on the delta's arrival
+#if defined(CONFIG_ESTIMATOR_KALMAN_IMU_PREINTEGRATION)
+        static const bool IMU_PREINTEGRATION = true;
+#else
+        static const bool IMU_PREINTEGRATION = false;
+#endif
+
+        // Fuse the flow deck's samples, rather than just draining them
+#if defined(CONFIG_ESTIMATOR_KALMAN_FLOW)
+        static const bool FLOW_FUSION = true;
+#else
+        static const bool FLOW_FUSION = false;
+#endif
+
+        // Each sensor has its own ring with a single producer (the IMU,
+        // flow and ranger tasks) and this task as its consumer, so the
+        // enqueue functions are safe from tasks and interrupts alike.  The
+        // only kernel call is the notification that wakes the task, once
+        // per flow or range sample and once per batch of IMU samples.
+
+        // The gyro and accel samples of a reading share a ring slot, so a
+        // full ring drops both and never leaves them out of step
+        void enqueueImu(
+                const Axis3f * gyro,
+                const Axis3f * accel,
+                const uint64_t timestamp)
         {
-            measurement_t m = {};
-            m.type = MeasurementTypeGyroscope;
-            m.data.gyroscope.gyro = *gyro;
-            enqueue(&m, isInInterrupt);
+            const imuSample_t m = { timestamp, *gyro, *accel };
+            imuDrops += !_imuRing.push(m);
+
+            // The IMU's own clock tells when a prediction is due
+            if (++_imuSamples == SAMPLES_PER_PREDICTION) {
+                _imuSamples = 0;
+                notify(EVENT_IMU | EVENT_PREDICT);
+            }
+            else if (_imuSamples % SAMPLES_PER_BATCH == 0) {
+                notify(EVENT_IMU);
+            }
         }
 
-        void enqueueAccel(const Axis3f * accel, const bool isInInterrupt)
+        void enqueueFlow(
+                const flowMeasurement_t * flow, const uint64_t timestamp)
         {
-            measurement_t m = {};
-            m.type = MeasurementTypeAcceleration;
-            m.data.acceleration.acc = *accel;
-            enqueue(&m, isInInterrupt);
+            const flowSample_t m = { timestamp, *flow };
+            flowDrops += !_flowRing.push(m);
+            notify(EVENT_FLOW);
         }
 
-        void enqueueFlow(const flowMeasurement_t * flow, const bool isInInterrupt)
+        void enqueueRange(const int16_t distance, const uint64_t timestamp)
         {
-            measurement_t m = {};
-            m.type = MeasurementTypeFlow;
-            m.data.flow = *flow;
-            enqueue(&m, isInInterrupt);
+            const rangeMeasurement_t m = { timestamp, (float)distance };
+            rangeDrops += !_rangeRing.push(m);
+            notify(EVENT_RANGE);
         }
 
-        void enqueueRange(const int16_t distance, const bool isInInterrupt)
+        void enqueueDelta(const imuDelta_t * delta)
         {
-            measurement_t m = {};
-            m.type = MeasurementTypeRange;
-            m.data.rangefinder_distance = distance;
-            enqueue(&m, isInInterrupt);
+            deltaDrops += !_deltaRing.push(*delta);
+            notify(EVENT_PREDICT);
         }
 
     private:
 
-        // this is slower than the IMU update rate of 1000Hz
-        static const uint32_t PREDICT_RATE = Clock::RATE_100_HZ; 
-        static const uint32_t PREDICTION_INTERVAL_MSEC = 1000 / PREDICT_RATE;
+        // Propagate the state mean on every IMU sample, and only the
+        // covariance at PREDICT_RATE
+#if defined(CONFIG_ESTIMATOR_KALMAN_IMU_RATE_MEAN)
+        static const bool IMU_RATE_MEAN = true;
+#else
+        static const bool IMU_RATE_MEAN = false;
+#endif
+        static const uint32_t IMU_RATE = 1000;
+
+        static_assert(IMU_RATE % PREDICT_RATE == 0,
+                "Kalman prediction rate must divide the 1 kHz IMU rate");
+
+        static const uint32_t SAMPLES_PER_PREDICTION = IMU_RATE / PREDICT_RATE;
+
+        // Wake for IMU samples often enough to keep their rings from
+        // filling between predictions
+        static const uint32_t SAMPLES_PER_BATCH = 8;
+
+        // Notification bits telling the task which work is pending
+        static const uint32_t EVENT_IMU     = 1 << 0;
+        static const uint32_t EVENT_RANGE   = 1 << 1;
+        static const uint32_t EVENT_FLOW    = 1 << 2;
+        static const uint32_t EVENT_PREDICT = 1 << 3;
+        static const uint32_t EVENT_ALL     = 0x0F;
 
 
         static const uint32_t WARNING_HOLD_BACK_TIME_MS = 2000;
 
-        static const size_t QUEUE_LENGTH = 20;
-        static const auto QUEUE_ITEM_SIZE = sizeof(measurement_t);
-        uint8_t measurementsQueueStorage[QUEUE_LENGTH * QUEUE_ITEM_SIZE];
-        StaticQueue_t measurementsQueueBuffer;
-        xQueueHandle _measurementsQueue;
+        // Room for two batches of IMU samples, should the task be held
+        // off; flow and range come in at 100 Hz or less
+        SpscRing<imuSample_t, 16> _imuRing;
+        SpscRing<flowSample_t, 4> _flowRing;
+        SpscRing<rangeMeasurement_t, 4> _rangeRing;
+        SpscRing<imuDelta_t, 4> _deltaRing;
 
+#if defined(CONFIG_ESTIMATOR_KALMAN_UD)
+        UdEKF _ekf;
+#else
         EKF _ekf;
+#endif
 
         RateSupervisor _rateSupervisor;
 
-        // Mutex to protect data that is shared between the task and
-        // functions called by the stabilizer loop
-        SemaphoreHandle_t _dataMutex;
-        StaticSemaphore_t _dataMutexBuffer;
-
-        // Semaphore to signal that we got data from the stabilizer loop to process
-        SemaphoreHandle_t _runTaskSemaphore;
+        // Owned by the IMU task
+        uint32_t _imuSamples;
 
         uint32_t _warningBlockTimeMsec;
 
         Safety * _safety;
 
-        // Data used to enable the task and stabilizer loop to run with minimal locking
-        // The estimator state produced by the task, copied to the stabilizer when needed.
-        vehicleState_t _state;
+        typedef struct {
+            vehicleState_t state;
+            sensorTimes_t times;
+        } publishedState_t;
+
+        // The estimator state produced by the task, copied to the
+        // stabilizer when needed, without locking
+        TripleBuffer<publishedState_t> _state;
+
+        sensorTimes_t _times;
+
+        // Newest IMU sample accumulated
+        uint64_t _imuUsec;
 
         static uint32_t msec(void)
         {
             return T2M(xTaskGetTickCount());
         }
 
-        uint32_t step(const uint32_t nowMsec, uint32_t nextPredictionMsec) 
+        void step(void) 
         {
-            xSemaphoreTake(_runTaskSemaphore, portMAX_DELAY);
+            // Sleep until there is something to do
+            uint32_t events = 0;
+            xTaskNotifyWait(0, EVENT_ALL, &events, portMAX_DELAY);
+
+            const auto nowMsec = msec();
 
             if (didResetEstimation) {
-                _ekf.initialize();
+                _ekf.initialize(IMU_RATE_MEAN);
                 didResetEstimation = false;
             }
 
-            // Run the system dynamics to predict the state forward.
-            if (nowMsec >= nextPredictionMsec) {
-
-                _ekf.predict(nowMsec);
-
-                nextPredictionMsec = nowMsec + PREDICTION_INTERVAL_MSEC;
-
-                if (!_rateSupervisor.validate(nowMsec)) {
-                    consolePrintf(
-                            "ESTIMATOR: WARNING: Kalman prediction rate off (%lu)\n", 
-                            _rateSupervisor.getLatestCount());
-                }
+            if (events & EVENT_IMU) {
+                accumulateImu();
             }
 
-            // Sensor measurements can come in sporadically and faster
-            // than the stabilizer loop frequency, we therefore consume all
-            // measurements since the last loop, rather than accumulating
-
-            // Pull the latest sensors values of interest; discard the rest
-            measurement_t measurement = {};
-            while (pdTRUE == xQueueReceive(
-                        _measurementsQueue, &measurement, 0)) {
+            // Run the system dynamics to predict the state forward.
+            if (events & EVENT_PREDICT) {
 
-                if (measurement.type == MeasurementTypeRange) {
+                if (IMU_PREINTEGRATION) {
 
-                    _ekf.update_with_range(measurement.data.rangefinder_distance, nowMsec); 
-                   
+                    imuDelta_t delta = {};
+                    while (_deltaRing.pop(delta)) {
+                        _ekf.accumulate_delta(delta);
+                        _imuUsec = delta.timestamp;
+                        predict(nowMsec);
+                    }
                 }
 
-                else if (measurement.type == MeasurementTypeFlow) {
-
-                    _ekf.update_with_flow(
-                            measurement.data.flow.dt, 
-                            measurement.data.flow.dpixelx,
-                            measurement.data.flow.dpixely);
+                else {
+                    predict(nowMsec);
                 }
+            }
 
-                else if (measurement.type == MeasurementTypeGyroscope ) {
-                    axis3_t gyro = {};
-                    memcpy(&gyro, &measurement.data.gyroscope.gyro, sizeof(gyro));
-                    _ekf.accumulate_gyro(nowMsec, gyro);
+            // The filter fuses delayed measurements at their own epochs, so
+            // their order relative to the IMU samples doesn't matter
+            if (events & EVENT_RANGE) {
+                rangeMeasurement_t range = {};
+                while (_rangeRing.pop(range)) {
+                    _ekf.update_with_range(range.distance, range.timestamp); 
+                    _times.range = range.timestamp;
                 }
+            }
 
-                else if (measurement.type == MeasurementTypeAcceleration) {
-                    axis3_t accel = {};
-                    memcpy(&accel, &measurement.data.acceleration.acc, 
-                            sizeof(accel));
-                    _ekf.accumulate_accel(nowMsec, accel);
+            if (events & EVENT_FLOW) {
+                flowSample_t flow = {};
+                while (_flowRing.pop(flow)) {
+                    if (!FLOW_FUSION) {
+                        continue;
+                    }
+                    _ekf.update_with_flow(
+                            flow.flow.dt, 
+                            flow.flow.dpixelx,
+                            flow.flow.dpixely,
+                            flow.timestamp);
+                    _times.flow = flow.timestamp;
                 }
             }
 
-            if (!_ekf.finalize(nowMsec)) { // state OOB
+            if (!_ekf.finalize()) { // state OOB
 
                 didResetEstimation = true;
 
@@ -213,14 +288,58 @@ class EstimatorTask : public FreeRTOSTask {
                 }
             }
 
-            xSemaphoreTake(_dataMutex, portMAX_DELAY);
+            auto & published = _state.back();
+            _ekf.get_vehicle_state(published.state);
+            published.times = _times;
 
+            stateOverwrites += _state.publish();
+        }
 
-            _ekf.get_vehicle_state(_state, nowMsec);
+        void accumulateImu(void)
+        {
+            imuSample_t imu = {};
+            while (_imuRing.pop(imu)) {
 
-            xSemaphoreGive(_dataMutex);
+                axis3_t g = {};
+                memcpy(&g, &imu.gyro, sizeof(g));
+                _ekf.accumulate_gyro(imu.timestamp, g);
 
-            return nextPredictionMsec;
+                axis3_t a = {};
+                memcpy(&a, &imu.acc, sizeof(a));
+                _ekf.accumulate_accel(imu.timestamp, a);
+
+                _imuUsec = imu.timestamp;
+            }
+        }
+
+        void notify(const uint32_t events)
+        {
+            if (!_taskHandle) {
+                return;
+            }
+
+            if (hal_isInInterrupt()) {
+                auto xHigherPriorityTaskWoken = pdFALSE;
+                xTaskNotifyFromISR(_taskHandle, events, eSetBits,
+                        &xHigherPriorityTaskWoken);
+                portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+            } else {
+                xTaskNotify(_taskHandle, events, eSetBits);
+            }
+        }
+
+        void predict(const uint32_t nowMsec)
+        {
+            _ekf.predict();
+
+            // The state now reflects the IMU samples up to here
+            _times.imu = _imuUsec;
+
+            if (!_rateSupervisor.validate(nowMsec)) {
+                consolePrintf(
+                        "ESTIMATOR: WARNING: Kalman prediction rate off (%lu)\n", 
+                        _rateSupervisor.getLatestCount());
+            }
         }
 
         static void runEstimatorTask(void * obj) 
@@ -234,10 +353,8 @@ class EstimatorTask : public FreeRTOSTask {
 
             systemWaitStart();
 
-            auto nextPredictionMsec = msec();
-
             _rateSupervisor.init(
-                    nextPredictionMsec, 
+                    msec(), 
                     1000, 
                     PREDICT_RATE - 1, 
                     PREDICT_RATE + 1, 
@@ -245,28 +362,10 @@ class EstimatorTask : public FreeRTOSTask {
 
             while (true) {
 
-                // would be nice if this had a precision higher than 1ms...
-                nextPredictionMsec = step(msec(), nextPredictionMsec);
-            }
-        }
-
-        void enqueue(
-                const measurement_t * measurement, 
-                const bool isInInterrupt)
-        {
-            if (!_measurementsQueue) {
-                return;
-            }
-
-            if (isInInterrupt) {
-                auto xHigherPriorityTaskWoken = pdFALSE;
-                xQueueSendFromISR(
-                        _measurementsQueue, measurement, &xHigherPriorityTaskWoken);
-                if (xHigherPriorityTaskWoken == pdTRUE) {
-                    portYIELD();
-                }
-            } else {
-                xQueueSend(_measurementsQueue, measurement, 0);
+                // The sensor tasks wake us with the work they have for us;
+                // the prediction itself integrates over the IMU's
+                // microsecond timestamps
+                step();
             }
         }
 };
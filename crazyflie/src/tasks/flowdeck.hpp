@@ -92,12 +92,16 @@ class FlowDeckTask : public FreeRTOSTask {
 
                     // Form flow measurement struct and push into the EKF
                     flowMeasurement_t flowData;
-                    flowData.dt = (float)(micros()-lastTime)/1000000.0f;
+                    const auto now = micros();
+                    flowData.dt = (float)(now - lastTime)/1000000.0f;
+                    // The pixel counts are accumulated over dt, so the
+                    // measurement belongs to the middle of the interval
+                    const auto timestamp = now - (now - lastTime) / 2;
                     // we do want to update dt every measurement and not only in the
                     // ones with detected motion, as we work with instantaneous gyro
                     // and velocity values in the update function
                     // (meaning assuming the current measurements over all of dt)
-                    lastTime = micros();
+                    lastTime = now;
 
                     // Use raw measurements
                     flowData.dpixelx = (float)accpx;
@@ -106,7 +110,7 @@ class FlowDeckTask : public FreeRTOSTask {
                     // Push measurements into the estimator if flow is not disabled
                     //    and the PMW flow sensor indicates motion detection
                     if (gotMotion) {
-                        _estimatorTask->enqueueFlow(&flowData, hal_isInInterrupt());
+                        _estimatorTask->enqueueFlow(&flowData, timestamp);
                     }
                 }
             }        
@@ -17,20 +17,34 @@
 #pragma once
 
 #include <math.h>
+#include <string.h>
+
+#include <free_rtos.h>
+#include <semphr.h>
+
+#include <autoconf.h>
 
 #include <task.hpp>
 #include <tasks/estimator.hpp>
 
 #include <console.h>
 #include <crossplatform.h>
+#include <imu_preintegrator.hpp>
 #include <lpf.hpp>
 #include <m_pi.h>
 #include <datatypes.h>
+#include <dynamic_notch.hpp>
+#include <triple_buffer.hpp>
 
 class ImuTask : public FreeRTOSTask {
 
     public:
 
+#if defined(CONFIG_IMU_GYRO_DYNAMIC_NOTCH)
+        // Shared with logger
+        DynamicNotch dynamicNotch;
+#endif
+
         // Called from main program
         void begin(
                 EstimatorTask * estimatorTask, 
@@ -56,12 +70,6 @@ class ImuTask : public FreeRTOSTask {
 
             calibrate(calibRoll, calibPitch);
 
-            accelQueue = makeImuQueue(accelQueueStorage, &accelQueueBuffer);
-
-            gyroQueue = makeImuQueue(gyroQueueStorage, &gyroQueueBuffer);
-
-            magQueue = makeImuQueue(magQueueStorage, &magQueueBuffer);
-
             FreeRTOSTask::begin(runImuTask, "imu", this, 3);
 
             didInit = true;
@@ -106,14 +114,17 @@ class ImuTask : public FreeRTOSTask {
             xSemaphoreTake(dataReady, portMAX_DELAY);
         }
 
-        // Called by core task
-        void acquire(sensorData_t *sensors)
+        // Called by core task; returns the number of samples published
+        // since the previous call that it never saw
+        uint32_t acquire(sensorData_t *sensors)
         {
-            xQueueReceive(gyroQueue, &sensors->gyro, 0);
-            xQueueReceive(accelQueue, &sensors->acc, 0);
-            xQueueReceive(magQueue, &sensors->mag, 0);
+            _snapshot.read(*sensors);
+
+            const auto advance = sensors->sequence - _lastSequence;
+
+            _lastSequence = sensors->sequence;
 
-            sensors->interruptTimestamp = data.interruptTimestamp;
+            return advance > 1 ? advance - 1 : 0;
         }
 
     private:
@@ -153,6 +164,27 @@ class ImuTask : public FreeRTOSTask {
         static constexpr float UPDATE_DT =  1.0f / UPDATE_FREQ;
 
         static const uint32_t READ_RATE_HZ = 1000;
+
+        // In 2 kHz gyro mode, the gyro runs at twice the read rate into its
+        // FIFO, and each batch is filtered sample by sample and decimated to
+        // its last one.  The watermark is one read period of samples, so the
+        // interrupt rate stays at READ_RATE_HZ: it clocks this task and the
+        // core loop.  An interrupt promises exactly the watermark's worth,
+        // so only every GYRO_FIFO_CHECK_READS reads is the FIFO's fill level
+        // read as well, to drain any samples this task fell behind on.
+#if defined(CONFIG_IMU_GYRO_FIFO)
+        static const bool GYRO_FIFO = true;
+#else
+        static const bool GYRO_FIFO = false;
+#endif
+        static const uint8_t GYRO_FIFO_WATERMARK = 2;
+        static const uint8_t GYRO_FIFO_MAX_FRAMES = 16;
+        static const uint32_t GYRO_FIFO_CHECK_READS = 100;
+        static const uint32_t GYRO_RATE_HZ =
+            GYRO_FIFO ? GYRO_FIFO_WATERMARK * READ_RATE_HZ : READ_RATE_HZ;
+        static const uint32_t GYRO_PERIOD_USEC = 1000000 / GYRO_RATE_HZ;
+        static const uint32_t SAMPLES_PER_DELTA =
+            READ_RATE_HZ / EstimatorTask::PREDICT_RATE;
         static const uint32_t READ_BARO_HZ = 50;
         static const uint32_t READ_MAG_HZ = 20;
         static const uint32_t DELAY_MAG = READ_RATE_HZ/READ_MAG_HZ;
@@ -163,22 +195,51 @@ class ImuTask : public FreeRTOSTask {
         static const uint32_t ACC_SCALE_SAMPLES = 200;
         static const uint32_t DELAY_BARO = READ_RATE_HZ/READ_BARO_HZ;
 
-        // IMU alignment on the airframe 
+        // IMU alignment on the airframe, in degrees
+#if defined(CONFIG_IMU_ALIGN_PHI)
+        static constexpr float ALIGN_PHI   = CONFIG_IMU_ALIGN_PHI;
+        static constexpr float ALIGN_THETA = CONFIG_IMU_ALIGN_THETA;
+        static constexpr float ALIGN_PSI   = CONFIG_IMU_ALIGN_PSI;
+#else
         static constexpr float ALIGN_PHI   = 0;
         static constexpr float ALIGN_THETA = 0;
         static constexpr float ALIGN_PSI   = 0;
+#endif
 
-        // Number of samples used in variance calculation. Changing this
-        // effects the threshold
-        static const uint16_t NBR_OF_BIAS_SAMPLES = 512;
+        // With the IMU mounted square, the gyro needs no rotation at all
+        static const bool IS_ALIGNED =
+            ALIGN_PHI == 0 && ALIGN_THETA == 0 && ALIGN_PSI == 0;
+
+        // The bias window and variance threshold below were tuned for a
+        // 1 kHz gyro, and scale with its rate
+        static const uint32_t BIAS_TUNED_RATE_HZ = 1000;
 
-        // Variance threshold to take zero bias for gyro
-        static constexpr float GYRO_VARIANCE_BASE = 100;
+        // Number of samples used in variance calculation. Changing this
+        // effects the threshold.  The window keeps its length in time.
+        static const uint16_t NBR_OF_BIAS_SAMPLES =
+            512 * GYRO_RATE_HZ / BIAS_TUNED_RATE_HZ;
+
+        // Variance threshold to take zero bias for gyro.  The BMI088's
+        // filter bandwidth scales with its output rate (116 Hz at 1 kHz,
+        // 230 Hz at 2 kHz), and the variance of its noise with that.
+        static constexpr float GYRO_VARIANCE_BASE =
+            100.f * GYRO_RATE_HZ / BIAS_TUNED_RATE_HZ;
         static constexpr float GYRO_VARIANCE_THRESHOLD_X = GYRO_VARIANCE_BASE;
         static constexpr float GYRO_VARIANCE_THRESHOLD_Y = GYRO_VARIANCE_BASE;
         static constexpr float GYRO_VARIANCE_THRESHOLD_Z = GYRO_VARIANCE_BASE;
 
-        static constexpr float GYRO_LPF_CUTOFF_FREQ  = 80;
+        // With the motor noise notched out, the gyro low-pass filter can
+        // be opened up for less phase lag in the rate loop
+#if defined(CONFIG_IMU_GYRO_DYNAMIC_NOTCH)
+        static const bool DYNAMIC_NOTCH = true;
+#else
+        static const bool DYNAMIC_NOTCH = false;
+#endif
+        static constexpr float NOTCH_MIN_HZ = 80;
+        static constexpr float NOTCH_MAX_HZ = 400;
+        static constexpr float NOTCH_Q = 3;
+
+        static constexpr float GYRO_LPF_CUTOFF_FREQ = DYNAMIC_NOTCH ? 120 : 80;
         static constexpr float ACCEL_LPF_CUTOFF_FREQ = 30;
 
         static const uint32_t GYRO_MIN_BIAS_TIMEOUT_MS = 1000;
@@ -192,57 +253,37 @@ class ImuTask : public FreeRTOSTask {
             bool       isBufferFilled;
             Axis3i16*  bufHead;
             Axis3i16   buffer[NBR_OF_BIAS_SAMPLES];
+            int32_t    sum[3];   // over the buffer, kept as samples come
+            int64_t    sumSq[3]; // and go
 
         } bias_t;
 
+        // Exact integer running sums make this constant-time, with the same
+        // results as summing the whole buffer
         static void calculateVarianceAndMean(
                 bias_t* bias, Axis3f* varOut, Axis3f* meanOut)
         {
-            uint32_t i;
-            int64_t sum[3] = {0};
-            int64_t sumSq[3] = {0};
-
-            for (i = 0; i < NBR_OF_BIAS_SAMPLES; i++)
-            {
-                sum[0] += bias->buffer[i].x;
-                sum[1] += bias->buffer[i].y;
-                sum[2] += bias->buffer[i].z;
-                sumSq[0] += bias->buffer[i].x * bias->buffer[i].x;
-                sumSq[1] += bias->buffer[i].y * bias->buffer[i].y;
-                sumSq[2] += bias->buffer[i].z * bias->buffer[i].z;
-            }
-
-            meanOut->x = (float) sum[0] / NBR_OF_BIAS_SAMPLES;
-            meanOut->y = (float) sum[1] / NBR_OF_BIAS_SAMPLES;
-            meanOut->z = (float) sum[2] / NBR_OF_BIAS_SAMPLES;
+            meanOut->x = (float) bias->sum[0] / NBR_OF_BIAS_SAMPLES;
+            meanOut->y = (float) bias->sum[1] / NBR_OF_BIAS_SAMPLES;
+            meanOut->z = (float) bias->sum[2] / NBR_OF_BIAS_SAMPLES;
 
-            varOut->x = sumSq[0] / NBR_OF_BIAS_SAMPLES - meanOut->x * meanOut->x;
-            varOut->y = sumSq[1] / NBR_OF_BIAS_SAMPLES - meanOut->y * meanOut->y;
-            varOut->z = sumSq[2] / NBR_OF_BIAS_SAMPLES - meanOut->z * meanOut->z;
+            varOut->x = bias->sumSq[0] / NBR_OF_BIAS_SAMPLES - meanOut->x * meanOut->x;
+            varOut->y = bias->sumSq[1] / NBR_OF_BIAS_SAMPLES - meanOut->y * meanOut->y;
+            varOut->z = bias->sumSq[2] / NBR_OF_BIAS_SAMPLES - meanOut->z * meanOut->z;
         }
 
-        static const uint8_t QUEUE_LENGTH = 1;
-
-        static const auto IMU_ITEM_SIZE = sizeof(Axis3f);
+        // Each sample's gyro, accel and timestamp go to the core task
+        // together, numbered so that it can tell when it missed one
+        TripleBuffer<sensorData_t> _snapshot;
 
-        static const auto IMU_QUEUE_LENGTH = QUEUE_LENGTH * IMU_ITEM_SIZE;
-
-        uint8_t accelQueueStorage[IMU_QUEUE_LENGTH];
-        StaticQueue_t accelQueueBuffer;
-        xQueueHandle accelQueue;
-
-        uint8_t gyroQueueStorage[IMU_QUEUE_LENGTH];
-        StaticQueue_t gyroQueueBuffer;
-        xQueueHandle gyroQueue;
-
-        uint8_t magQueueStorage[IMU_QUEUE_LENGTH];
-        StaticQueue_t magQueueBuffer;
-        xQueueHandle magQueue;
+        uint32_t _lastSequence; // reader side
 
         bias_t gyroBiasRunning;
 
         EstimatorTask * _estimatorTask;
 
+        ImuPreintegrator _preintegrator;
+
 
         /**
          * Checks if the variances is below the predefined thresholds.
@@ -276,22 +317,15 @@ class ImuTask : public FreeRTOSTask {
             return foundBias;
         }
 
-        static void applyLpf(Lpf lpf[3], Axis3f* in)
-        {
-            for (uint8_t i = 0; i < 3; i++) {
-                in->axis[i] = lpf[i].apply(in->axis[i]);
-            }
-        }
-
         // Low Pass filtering
-        Lpf _accLpf[3];
-        Lpf _gyroLpf[3];
+        Lpf3<> _accLpf;
+        Lpf3<> _gyroLpf;
 
-        // Pre-calculated values for accelerometer alignment
-        float _cosPitch;
-        float _sinPitch;
-        float _cosRoll;
-        float _sinRoll;
+        // Rotations from the IMU to the airframe, for the gyro, and on
+        // through the trim to gravity, for the accelerometer; computed once
+        float _gyroRotation[3][3];
+        float _accRotation[3][3];
+        bool _isAccRotated;
 
         /**
          * Adds a new value to the variance buffer and if it is full
@@ -299,9 +333,14 @@ class ImuTask : public FreeRTOSTask {
          */
         void addBiasValue(int16_t x, int16_t y, int16_t z)
         {
+            if (gyroBiasRunning.isBufferFilled) {
+                updateBiasSums(gyroBiasRunning.bufHead, -1);
+            }
+
             gyroBiasRunning.bufHead->x = x;
             gyroBiasRunning.bufHead->y = y;
             gyroBiasRunning.bufHead->z = z;
+            updateBiasSums(gyroBiasRunning.bufHead, +1);
             gyroBiasRunning.bufHead++;
 
             if (gyroBiasRunning.bufHead >= 
@@ -312,49 +351,52 @@ class ImuTask : public FreeRTOSTask {
             }
         }
 
-        static xQueueHandle makeImuQueue(
-                uint8_t storage[], StaticQueue_t * buffer)
+        void updateBiasSums(const Axis3i16 * sample, const int8_t sign)
         {
-            return makeQueue(IMU_ITEM_SIZE, storage, buffer);
+            const int16_t axes[3] = {sample->x, sample->y, sample->z};
 
+            for (uint8_t i = 0; i < 3; i++) {
+                gyroBiasRunning.sum[i] += sign * axes[i];
+                gyroBiasRunning.sumSq[i] += sign * (int32_t)axes[i] * axes[i];
+            }
         }
 
-        static xQueueHandle makeQueue(
-                const uint8_t itemSize, uint8_t storage[], StaticQueue_t * buffer)
+        void alignGyro(const Axis3f* in, Axis3f* out) const
         {
-            return xQueueCreateStatic(QUEUE_LENGTH, itemSize, storage, buffer);
-
+            if (IS_ALIGNED) {
+                *out = *in;
+            } else {
+                rotate(_gyroRotation, in, out);
+            }
         }
 
-        static void alignToAirframe(Axis3f* in, Axis3f* out)
+        void alignAccel(const Axis3f* in, Axis3f* out) const
         {
-            static float R[3][3];
-
-            // IMU alignment
-            static float sphi, cphi, stheta, ctheta, spsi, cpsi;
-
-            sphi   = sinf(ALIGN_PHI * (float) M_PI / 180);
-            cphi   = cosf(ALIGN_PHI * (float) M_PI / 180);
-            stheta = sinf(ALIGN_THETA * (float) M_PI / 180);
-            ctheta = cosf(ALIGN_THETA * (float) M_PI / 180);
-            spsi   = sinf(ALIGN_PSI * (float) M_PI / 180);
-            cpsi   = cosf(ALIGN_PSI * (float) M_PI / 180);
-
-            R[0][0] = ctheta * cpsi;
-            R[0][1] = ctheta * spsi;
-            R[0][2] = -stheta;
-            R[1][0] = sphi * stheta * cpsi - cphi * spsi;
-            R[1][1] = sphi * stheta * spsi + cphi * cpsi;
-            R[1][2] = sphi * ctheta;
-            R[2][0] = cphi * stheta * cpsi + sphi * spsi;
-            R[2][1] = cphi * stheta * spsi - sphi * cpsi;
-            R[2][2] = cphi * ctheta;
+            if (_isAccRotated) {
+                rotate(_accRotation, in, out);
+            } else {
+                *out = *in;
+            }
+        }
 
+        static void rotate(const float R[3][3], const Axis3f* in, Axis3f* out)
+        {
             out->x = in->x*R[0][0] + in->y*R[0][1] + in->z*R[0][2];
             out->y = in->x*R[1][0] + in->y*R[1][1] + in->z*R[1][2];
             out->z = in->x*R[2][0] + in->y*R[2][1] + in->z*R[2][2];
         }
 
+        static void multiply(
+                const float A[3][3], const float B[3][3], float out[3][3])
+        {
+            for (uint8_t i = 0; i < 3; i++) {
+                for (uint8_t j = 0; j < 3; j++) {
+                    out[i][j] =
+                        A[i][0]*B[0][j] + A[i][1]*B[1][j] + A[i][2]*B[2][j];
+                }
+            }
+        }
+
         bool gyroBiasFound;
         sensorData_t data;
         Axis3i16 gyroRaw;
@@ -372,50 +414,77 @@ class ImuTask : public FreeRTOSTask {
 
         void applyAccelLpf(Axis3f * accelVals)
         {
-            applyLpf(_accLpf, accelVals);
+            _accLpf.apply(*accelVals);
         }
 
         void applyGyroLpf(Axis3f * gyroVals)
         {
-            applyLpf(_gyroLpf, gyroVals);
+            _gyroLpf.apply(*gyroVals);
         }
 
         void calibrate(const float calibRoll, const float calibPitch)
         {
-            for (uint8_t i = 0; i < 3; i++) {
-                _gyroLpf[i].init(1000, GYRO_LPF_CUTOFF_FREQ);
-                _accLpf[i].init(1000, ACCEL_LPF_CUTOFF_FREQ);
-            }
+            _gyroLpf.init(GYRO_RATE_HZ, GYRO_LPF_CUTOFF_FREQ);
+            _accLpf.init(1000, ACCEL_LPF_CUTOFF_FREQ);
 
-            _cosPitch = cosf(calibPitch * (float) M_PI / 180);
-            _sinPitch = sinf(calibPitch * (float) M_PI / 180);
-            _cosRoll = cosf(calibRoll * (float) M_PI / 180);
-            _sinRoll = sinf(calibRoll * (float) M_PI / 180);
-        }
+#if defined(CONFIG_IMU_GYRO_DYNAMIC_NOTCH)
+            dynamicNotch.init(GYRO_RATE_HZ, NOTCH_MIN_HZ, NOTCH_MAX_HZ, NOTCH_Q);
+#endif
 
-        /**
-         * Compensate for a miss-aligned accelerometer. It uses the trim
-         * data gathered from the UI and written in the config-block to
-         * rotate the accelerometer to be aligned with gravity.
-         */
-        void accAlignToGravity(Axis3f* in, Axis3f* out)
-        {
-            Axis3f rx;
-            Axis3f ry;
-
-            // Rotate around x-axis
-            rx.x = in->x;
-            rx.y = in->y * _cosRoll - in->z * _sinRoll;
-            rx.z = in->y * _sinRoll + in->z * _cosRoll;
-
-            // Rotate around y-axis
-            ry.x = rx.x * _cosPitch - rx.z * _sinPitch;
-            ry.y = rx.y;
-            ry.z = -rx.x * _sinPitch + rx.z * _cosPitch;
-
-            out->x = ry.x;
-            out->y = ry.y;
-            out->z = ry.z;
+            // IMU alignment
+            const float sphi   = sinf(ALIGN_PHI * (float) M_PI / 180);
+            const float cphi   = cosf(ALIGN_PHI * (float) M_PI / 180);
+            const float stheta = sinf(ALIGN_THETA * (float) M_PI / 180);
+            const float ctheta = cosf(ALIGN_THETA * (float) M_PI / 180);
+            const float spsi   = sinf(ALIGN_PSI * (float) M_PI / 180);
+            const float cpsi   = cosf(ALIGN_PSI * (float) M_PI / 180);
+
+            const float align[3][3] = {
+                {
+                    ctheta * cpsi,
+                    ctheta * spsi,
+                    -stheta
+                },
+                {
+                    sphi * stheta * cpsi - cphi * spsi,
+                    sphi * stheta * spsi + cphi * cpsi,
+                    sphi * ctheta
+                },
+                {
+                    cphi * stheta * cpsi + sphi * spsi,
+                    cphi * stheta * spsi - sphi * cpsi,
+                    cphi * ctheta
+                }
+            };
+
+            memcpy(_gyroRotation, align, sizeof(_gyroRotation));
+
+            // Compensate for a miss-aligned accelerometer, using the trim
+            // data gathered from the UI and written in the config-block to
+            // rotate the accelerometer to be aligned with gravity: first
+            // around the x axis, then around the y axis
+            const float cosPitch = cosf(calibPitch * (float) M_PI / 180);
+            const float sinPitch = sinf(calibPitch * (float) M_PI / 180);
+            const float cosRoll = cosf(calibRoll * (float) M_PI / 180);
+            const float sinRoll = sinf(calibRoll * (float) M_PI / 180);
+
+            const float trimRoll[3][3] = {
+                {1, 0,        0       },
+                {0, cosRoll, -sinRoll },
+                {0, sinRoll,  cosRoll }
+            };
+
+            const float trimPitch[3][3] = {
+                { cosPitch, 0, -sinPitch },
+                { 0,        1,  0        },
+                {-sinPitch, 0,  cosPitch }
+            };
+
+            float trim[3][3];
+            multiply(trimPitch, trimRoll, trim);
+            multiply(trim, align, _accRotation);
+
+            _isAccRotated = !IS_ALIGNED || calibRoll != 0 || calibPitch != 0;
         }
 
         /**
@@ -442,6 +511,8 @@ class ImuTask : public FreeRTOSTask {
         {
             gyroBiasRunning.isBufferFilled = false;
             gyroBiasRunning.bufHead = gyroBiasRunning.buffer;
+            memset(gyroBiasRunning.sum, 0, sizeof(gyroBiasRunning.sum));
+            memset(gyroBiasRunning.sumSq, 0, sizeof(gyroBiasRunning.sumSq));
         }
 
         bool processAccelScale(int16_t ax, int16_t ay, int16_t az)
@@ -467,6 +538,73 @@ class ImuTask : public FreeRTOSTask {
         }
 
 
+        void sendToEstimator(void)
+        {
+            if (!EstimatorTask::IMU_PREINTEGRATION) {
+                _estimatorTask->enqueueImu(
+                        &data.gyro, &data.acc, data.interruptTimestamp);
+                return;
+            }
+
+            _preintegrator.integrate(
+                    data.gyro, data.acc, data.interruptTimestamp);
+
+            if (_preintegrator.count() == SAMPLES_PER_DELTA) {
+                imuDelta_t delta = {};
+                _preintegrator.take(delta);
+                _estimatorTask->enqueueDelta(&delta);
+            }
+        }
+
+        // Calibrates, scales, aligns and filters one gyro sample
+        void processGyro(const Axis3i16 & raw)
+        {
+            gyroBiasFound = processGyroBias(xTaskGetTickCount(),
+                    raw.x, raw.y, raw.z, &gyroBias);
+
+            Axis3f gyroScaledIMU;
+
+            gyroScaledIMU.x = (raw.x - gyroBias.x) * DEG_PER_LSB;
+            gyroScaledIMU.y = (raw.y - gyroBias.y) * DEG_PER_LSB;
+            gyroScaledIMU.z = (raw.z - gyroBias.z) * DEG_PER_LSB;
+
+            alignGyro(&gyroScaledIMU, &data.gyro);
+
+#if defined(CONFIG_IMU_GYRO_DYNAMIC_NOTCH)
+            dynamicNotch.apply(data.gyro);
+#endif
+
+            applyGyroLpf(&data.gyro);
+        }
+
+        void readGyroBatch(void)
+        {
+            Axis3i16 frames[GYRO_FIFO_MAX_FRAMES];
+
+            uint8_t count = GYRO_FIFO_WATERMARK;
+
+            if (data.sequence % GYRO_FIFO_CHECK_READS == 0) {
+                count = readGyroFifoCount();
+                if (count > GYRO_FIFO_MAX_FRAMES) {
+                    count = GYRO_FIFO_MAX_FRAMES;
+                }
+            }
+
+            readGyroFifo(frames, count);
+
+            for (uint8_t k=0; k<count; ++k) {
+                processGyro(frames[k]);
+            }
+
+            // The watermark frame arrived at the interrupt; any after it
+            // came while we were getting here
+            if (count > 0) {
+                data.interruptTimestamp +=
+                    ((int32_t)count - GYRO_FIFO_WATERMARK) * 
+                    (int32_t)GYRO_PERIOD_USEC;
+            }
+        }
+
         static void runImuTask(void *obj)
         {
             ((ImuTask *)obj)->run();
@@ -480,48 +618,37 @@ class ImuTask : public FreeRTOSTask {
 
             while (true) {
 
-                Axis3f gyroScaledIMU;
                 Axis3f accScaledIMU;
-                Axis3f accScaled;
 
                 if (pdTRUE == xSemaphoreTake(sensorsDataReady, portMAX_DELAY)) {
 
                     data.interruptTimestamp = interruptTimestamp;
 
                     // Get data from chosen sensors 
-                    readGyro(&gyroRaw);
-                    readAccel(&accelRaw);
-
-                    // Calibrate if necessary */
-                    gyroBiasFound = processGyroBias(xTaskGetTickCount(),
-                            gyroRaw.x, gyroRaw.y, gyroRaw.z, 
-                            &gyroBias);
-
-                    // Gyro
-                    gyroScaledIMU.x =  
-                        (gyroRaw.x - gyroBias.x) * DEG_PER_LSB;
-                    gyroScaledIMU.y =  
-                        (gyroRaw.y - gyroBias.y) * DEG_PER_LSB;
-                    gyroScaledIMU.z =  
-                        (gyroRaw.z - gyroBias.z) * DEG_PER_LSB;
+                    if (GYRO_FIFO) {
+                        readGyroBatch();
+                    } else {
+                        readGyro(&gyroRaw);
+                        processGyro(gyroRaw);
+                    }
 
-                    alignToAirframe(&gyroScaledIMU, &data.gyro);
-                    applyGyroLpf(&data.gyro);
-                    _estimatorTask->enqueueGyro(&data.gyro, hal_isInInterrupt());
+                    readAccel(&accelRaw);
 
                     // Acelerometer
                     accScaledIMU.x = accelRaw.x * G_PER_LSB / accScale;
                     accScaledIMU.y = accelRaw.y * G_PER_LSB / accScale;
                     accScaledIMU.z = accelRaw.z * G_PER_LSB / accScale;
 
-                    alignToAirframe(&accScaledIMU, &accScaled);
-                    accAlignToGravity(&accScaled, &data.acc);
+                    alignAccel(&accScaledIMU, &data.acc);
                     applyAccelLpf(&data.acc);
-                    _estimatorTask->enqueueAccel(&data.acc, hal_isInInterrupt());
-                }
 
-                xQueueOverwrite(accelQueue, &data.acc);
-                xQueueOverwrite(gyroQueue, &data.gyro);
+                    sendToEstimator();
+
+                    data.sequence++;
+
+                    _snapshot.back() = data;
+                    _snapshot.publish();
+                }
 
                 xSemaphoreGive(dataReady);
             }
@@ -531,5 +658,7 @@ class ImuTask : public FreeRTOSTask {
         bool gyroSelfTest();
         void deviceInit(void); 
         void readGyro(Axis3i16* dataOut);
+        uint8_t readGyroFifoCount(void);
+        void readGyroFifo(Axis3i16 dataOut[], const uint8_t count);
         void readAccel(Axis3i16* dataOut);
 };
@@ -1081,6 +1081,9 @@ static float unused;
 //////////////////////////////////////////////////////////////////////////////
 
 extern Safety safety;
+extern CoreTask coreTask;
+extern EstimatorTask estimatorTask;
+extern ImuTask imuTask;
 extern bool didResetEstimation;
 
 extern RadioLink radioLink;
@@ -1154,6 +1157,71 @@ LOG_GROUP_STOP(kalman)
     LOG_ADD(LOG_FLOAT, measNY, &unused)
 LOG_GROUP_STOP(kalman_pred)
 
+    LOG_GROUP_START(estimator)
+    LOG_ADD(LOG_UINT32, imuDrops, &estimatorTask.imuDrops)
+    LOG_ADD(LOG_UINT32, flowDrops, &estimatorTask.flowDrops)
+    LOG_ADD(LOG_UINT32, rangeDrops, &estimatorTask.rangeDrops)
+    LOG_ADD(LOG_UINT32, deltaDrops, &estimatorTask.deltaDrops)
+    LOG_ADD(LOG_UINT32, stateStale, &estimatorTask.stateStaleReads)
+    LOG_ADD(LOG_UINT32, stateOvwr, &estimatorTask.stateOverwrites)
+LOG_GROUP_STOP(estimator)
+
+    LOG_GROUP_START(latency)
+    LOG_ADD(LOG_UINT32, imuMin, &coreTask.imuLatency.min)
+    LOG_ADD(LOG_UINT32, imuMean, &coreTask.imuLatency.mean)
+    LOG_ADD(LOG_UINT32, imuMax, &coreTask.imuLatency.max)
+    LOG_ADD(LOG_UINT32, imuP99, &coreTask.imuLatency.p99)
+    LOG_ADD(LOG_UINT32, rangeMin, &coreTask.rangeLatency.min)
+    LOG_ADD(LOG_UINT32, rangeMean, &coreTask.rangeLatency.mean)
+    LOG_ADD(LOG_UINT32, rangeMax, &coreTask.rangeLatency.max)
+    LOG_ADD(LOG_UINT32, rangeP99, &coreTask.rangeLatency.p99)
+    LOG_ADD(LOG_UINT32, flowMin, &coreTask.flowLatency.min)
+    LOG_ADD(LOG_UINT32, flowMean, &coreTask.flowLatency.mean)
+    LOG_ADD(LOG_UINT32, flowMax, &coreTask.flowLatency.max)
+    LOG_ADD(LOG_UINT32, flowP99, &coreTask.flowLatency.p99)
+    LOG_ADD(LOG_UINT32, imuMissed, &coreTask.imuSamplesMissed)
+LOG_GROUP_STOP(latency)
+
+#if defined(CONFIG_DEBUG_CORE_LOOP_PROFILING)
+    LOG_GROUP_START(coreProf)
+    LOG_ADD(LOG_UINT32, waitMean, &coreTask.profiler.mean[LoopProfiler::STAGE_WAIT])
+    LOG_ADD(LOG_UINT32, waitMax, &coreTask.profiler.max[LoopProfiler::STAGE_WAIT])
+    LOG_ADD(LOG_UINT32, acqMean, &coreTask.profiler.mean[LoopProfiler::STAGE_ACQUIRE])
+    LOG_ADD(LOG_UINT32, acqMax, &coreTask.profiler.max[LoopProfiler::STAGE_ACQUIRE])
+    LOG_ADD(LOG_UINT32, stateMean, &coreTask.profiler.mean[LoopProfiler::STAGE_STATE])
+    LOG_ADD(LOG_UINT32, stateMax, &coreTask.profiler.max[LoopProfiler::STAGE_STATE])
+    LOG_ADD(LOG_UINT32, dmdMean, &coreTask.profiler.mean[LoopProfiler::STAGE_DEMANDS])
+    LOG_ADD(LOG_UINT32, dmdMax, &coreTask.profiler.max[LoopProfiler::STAGE_DEMANDS])
+    LOG_ADD(LOG_UINT32, safeMean, &coreTask.profiler.mean[LoopProfiler::STAGE_SAFETY])
+    LOG_ADD(LOG_UINT32, safeMax, &coreTask.profiler.max[LoopProfiler::STAGE_SAFETY])
+    LOG_ADD(LOG_UINT32, copMean, &coreTask.profiler.mean[LoopProfiler::STAGE_COPILOT])
+    LOG_ADD(LOG_UINT32, copMax, &coreTask.profiler.max[LoopProfiler::STAGE_COPILOT])
+    LOG_ADD(LOG_UINT32, scaleMean, &coreTask.profiler.mean[LoopProfiler::STAGE_SCALE])
+    LOG_ADD(LOG_UINT32, scaleMax, &coreTask.profiler.max[LoopProfiler::STAGE_SCALE])
+    LOG_ADD(LOG_UINT32, motMean, &coreTask.profiler.mean[LoopProfiler::STAGE_MOTORS])
+    LOG_ADD(LOG_UINT32, motMax, &coreTask.profiler.max[LoopProfiler::STAGE_MOTORS])
+    LOG_ADD(LOG_UINT32, acqWorst, &coreTask.profiler.worst[LoopProfiler::STAGE_ACQUIRE])
+    LOG_ADD(LOG_UINT32, stateWorst, &coreTask.profiler.worst[LoopProfiler::STAGE_STATE])
+    LOG_ADD(LOG_UINT32, dmdWorst, &coreTask.profiler.worst[LoopProfiler::STAGE_DEMANDS])
+    LOG_ADD(LOG_UINT32, safeWorst, &coreTask.profiler.worst[LoopProfiler::STAGE_SAFETY])
+    LOG_ADD(LOG_UINT32, copWorst, &coreTask.profiler.worst[LoopProfiler::STAGE_COPILOT])
+    LOG_ADD(LOG_UINT32, scaleWorst, &coreTask.profiler.worst[LoopProfiler::STAGE_SCALE])
+    LOG_ADD(LOG_UINT32, motWorst, &coreTask.profiler.worst[LoopProfiler::STAGE_MOTORS])
+    LOG_ADD(LOG_UINT32, worstTotal, &coreTask.profiler.worstTotal)
+LOG_GROUP_STOP(coreProf)
+#endif
+
+#if defined(CONFIG_IMU_GYRO_DYNAMIC_NOTCH)
+    LOG_GROUP_START(dynNotch)
+    LOG_ADD(LOG_FLOAT, x1, &imuTask.dynamicNotch.centerHz[0][0])
+    LOG_ADD(LOG_FLOAT, x2, &imuTask.dynamicNotch.centerHz[0][1])
+    LOG_ADD(LOG_FLOAT, y1, &imuTask.dynamicNotch.centerHz[1][0])
+    LOG_ADD(LOG_FLOAT, y2, &imuTask.dynamicNotch.centerHz[1][1])
+    LOG_ADD(LOG_FLOAT, z1, &imuTask.dynamicNotch.centerHz[2][0])
+    LOG_ADD(LOG_FLOAT, z2, &imuTask.dynamicNotch.centerHz[2][1])
+LOG_GROUP_STOP(dynNotch)
+#endif
+
     LOG_GROUP_START(stabilizer)
     LOG_ADD(LOG_FLOAT, thrust, &unused)
     LOG_ADD(LOG_FLOAT, roll, &unused)
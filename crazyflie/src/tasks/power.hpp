@@ -36,6 +36,7 @@
 
 #include <config.h>
 #include <ledseq.h>
+#include <motors.h>
 #include <platform_defaults.h>
 #include <system.h>
 #include <worker.hpp>
@@ -354,12 +355,14 @@ class PowerMonitorTask {
 
 
         /**
-         * Sets the battery voltage and its min and max values
+         * Sets the battery voltage and its min and max values, and passes it
+         * on to the motor thrust compensation
          */
         void setBatteryVoltage(float voltage)
         {
             batteryVoltage = voltage;
             batteryVoltageMV = (uint16_t)(voltage * 1000);
+            motorsSetSupplyVoltage(batteryVoltageMV);
             if (_batteryVoltageMax < voltage) {
                 _batteryVoltageMax = voltage;
             }
@@ -53,6 +53,8 @@ class ZRangerTask : public FreeRTOSTask {
 
         static const uint16_t OUTLIER_LIMIT_MM = 5000;
 
+        static const uint32_t TIMING_BUDGET_MSEC = 25;
+
         // Measurement noise model
         static constexpr float EXP_POINT_A = 2.5;
         static constexpr float EXP_STD_A = 0.0025; 
@@ -77,17 +79,21 @@ class ZRangerTask : public FreeRTOSTask {
             systemWaitStart();
 
             _vl53l1->setDistanceMode(VL53L1::DISTANCE_MODE_MEDIUM);
-            _vl53l1->setTimingBudgetMsec(25);
+            _vl53l1->setTimingBudgetMsec(TIMING_BUDGET_MSEC);
 
             lastWakeTime = xTaskGetTickCount();
 
             while (true) {
 
-                vTaskDelayUntil(&lastWakeTime, M2T(25));
+                vTaskDelayUntil(&lastWakeTime, M2T(TIMING_BUDGET_MSEC));
 
                 const auto range = _vl53l1->readDistance();
 
-                _estimatorTask->enqueueRange(range, hal_isInInterrupt());
+                // The range was measured over the preceding timing budget,
+                // so stamp it with the middle of that window
+                const auto timestamp = micros() - 500 * TIMING_BUDGET_MSEC;
+
+                _estimatorTask->enqueueRange(range, timestamp);
             }
         }
 };
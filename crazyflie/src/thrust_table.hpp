@@ -0,0 +1,189 @@
+/**
+ * Table-driven battery-voltage compensation of motor thrust
+ *
+ * Copyright (C) 2011-2012 Bitcraze AB, 2024 Simon D. Levy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <triple_buffer.hpp>
+
+// We have data that maps PWM to thrust at different supply voltage levels.
+// However, it is not the PWM that drives the motors but the voltage and
+// amps (= power). With the PWM it is possible to simulate different
+// voltage levels. The assumption is that the voltage used will be an
+// procentage of the supply voltage, we assume that 50% PWM will result in
+// 50% voltage.
+//
+//  Thrust (g)    Supply Voltage    PWM (%)     Voltage needed
+//  0.0           4.01              0           0
+//  1.6           3.98              6.25        0.24875
+//  4.8           3.95              12.25       0.49375
+//  7.9           3.82              18.75       0.735
+//  10.9          3.88              25          0.97
+//  13.9          3.84              31.25       1.2
+//  17.3          3.80              37.5        1.425
+//  21.0          3.76              43.25       1.6262
+//  24.4          3.71              50          1.855
+//  28.6          3.67              56.25       2.06438
+//  32.8          3.65              62.5        2.28125
+//  37.3          3.62              68.75       2.48875
+//  41.7          3.56              75          2.67
+//  46.0          3.48              81.25       2.8275
+//  51.9          3.40              87.5        2.975
+//  57.9          3.30              93.75       3.09375
+//
+// To get Voltage needed from wanted thrust we can get the quadratic
+// polyfit coefficients using GNU octave:
+//
+// thrust = [0.0 1.6 4.8 7.9 10.9 13.9 17.3 21.0 ...
+//           24.4 28.6 32.8 37.3 41.7 46.0 51.9 57.9]
+//
+// volts  = [0.0 0.24875 0.49375 0.735 0.97 1.2 1.425 1.6262 1.855 ...
+//           2.064375 2.28125 2.48875 2.67 2.8275 2.975 3.09375]
+//
+// p = polyfit(thrust, volts, 2)
+//
+// => p = -0.00062390   0.08835522   0.06865956
+//
+// We will not use the constant term, since we want zero thrust to equal
+// zero PWM.
+//
+// And to get the PWM as a percentage we would need to divide the
+// Voltage needed with the Supply voltage.
+
+/**
+ * The voltage needed along the thrust range is tabulated at compile time.
+ * Dividing it by the supply voltage gives the table of motor ratios, which
+ * is rebuilt, in integer math, only when the supply voltage changes; the
+ * power monitor publishes it to the core loop through a triple buffer.  Each
+ * motor command is then a linear interpolation between two entries.
+ */
+class ThrustTable {
+
+    private:
+
+        static const uint8_t STEP_BITS = 11;
+        static const uint32_t STEP = 1 << STEP_BITS;
+        static const uint8_t POINTS = (1 << (16 - STEP_BITS)) + 1;
+
+        static const uint16_t MIN_SUPPLY_MV = 2000;
+        static const uint16_t DEADBAND_MV = 10;
+
+        // Table volts are in units of 100 uV
+        static const uint16_t UNITS_PER_MV = 10;
+
+        static constexpr float MAX_THRUST_GRAMS = 60;
+
+        typedef struct {
+            uint16_t units[POINTS];
+        } voltsTable_t;
+
+        static constexpr voltsTable_t makeVoltsNeeded(void)
+        {
+            voltsTable_t table = {};
+
+            for (uint8_t k=0; k<POINTS; ++k) {
+                const float thrust = k * STEP * MAX_THRUST_GRAMS / 65536;
+                const float volts = -0.0006239f * thrust * thrust + 0.088f * thrust;
+                table.units[k] = volts * 1000 * UNITS_PER_MV + 0.5f;
+            }
+
+            return table;
+        }
+
+    public:
+
+        // Called when the battery voltage is measured; returns true if the
+        // table was rebuilt
+        bool setSupplyVoltage(const uint16_t millivolts)
+        {
+            const auto change = millivolts > _millivolts ?
+                millivolts - _millivolts : _millivolts - millivolts;
+
+            if (_didPublish && change < DEADBAND_MV) {
+                return false;
+            }
+
+            _millivolts = millivolts;
+            _didPublish = true;
+
+            static constexpr auto VOLTS_NEEDED = makeVoltsNeeded();
+
+            auto & table = _tables.back();
+
+            // A LiPo battery is supposed to be 4.2V charged, 3.7V mid-charge
+            // and 3V discharged.  Below 2V, which would suggest a damaged
+            // battery or a bad reading, we pass the thrust through rather
+            // than rushing the motors.
+            table.isValid = millivolts >= MIN_SUPPLY_MV;
+
+            if (table.isValid) {
+                for (uint8_t k=0; k<POINTS; ++k) {
+                    const uint32_t ratio =
+                        (uint32_t)VOLTS_NEEDED.units[k] * UINT16_MAX /
+                        (millivolts * UNITS_PER_MV);
+                    table.ratios[k] = ratio < UINT16_MAX ? ratio : UINT16_MAX;
+                }
+            }
+
+            _tables.publish();
+
+            return true;
+        }
+
+        // Called by the motor output once per tick, before apply()
+        void refresh(void)
+        {
+            table_t table;
+
+            if (_tables.read(table)) {
+                _current = table;
+            }
+        }
+
+        // Thrust is mapped for 65536 <==> 60 grams
+        uint16_t apply(const uint16_t thrust) const
+        {
+            if (!_current.isValid) {
+                return thrust;
+            }
+
+            const auto k = thrust >> STEP_BITS;
+            const int32_t frac = thrust & (STEP - 1);
+
+            const int32_t lo = _current.ratios[k];
+            const int32_t hi = _current.ratios[k + 1];
+
+            return lo + (((hi - lo) * frac) >> STEP_BITS);
+        }
+
+    private:
+
+        typedef struct {
+            bool isValid;
+            uint16_t ratios[POINTS];
+        } table_t;
+
+        TripleBuffer<table_t> _tables;
+
+        table_t _current;
+
+        // Writer side
+        uint16_t _millivolts;
+        bool _didPublish;
+};
@@ -0,0 +1,83 @@
+/**
+ * Wait-free triple buffer for publishing a value from one task to another
+ *
+ * Copyright (C) 2024 Simon D. Levy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * The writer fills its back buffer and swaps it with the middle one; the
+ * reader swaps its front buffer with the middle one when that holds
+ * something new.  Each side owns one buffer outright and the middle changes
+ * hands by a single atomic exchange, so neither side ever waits or retries,
+ * whatever the relative priorities of the two tasks.
+ *
+ * A seqlock would be smaller, but a high-priority reader that preempts the
+ * writer mid-update would then spin forever on a single core.
+ */
+template <typename T>
+class TripleBuffer {
+
+    public:
+
+        // The buffer to fill before calling publish()
+        T & back(void)
+        {
+            return _buffers[_back];
+        }
+
+        // Returns true if this replaced a value the reader never saw
+        bool publish(void)
+        {
+            const auto old = __atomic_exchange_n(
+                    &_middle, (uint8_t)(_back | FRESH), __ATOMIC_ACQ_REL);
+
+            _back = old & INDEX;
+
+            return (old & FRESH) != 0;
+        }
+
+        // Copies the latest value, returning false if it was already read
+        bool read(T & item)
+        {
+            const auto isFresh =
+                (__atomic_load_n(&_middle, __ATOMIC_ACQUIRE) & FRESH) != 0;
+
+            // Only the writer can touch the middle meanwhile, and it can only
+            // leave it fresh
+            if (isFresh) {
+                _front = __atomic_exchange_n(
+                        &_middle, _front, __ATOMIC_ACQ_REL) & INDEX;
+            }
+
+            item = _buffers[_front];
+
+            return isFresh;
+        }
+
+    private:
+
+        static const uint8_t INDEX = 0x03;
+        static const uint8_t FRESH = 0x04;
+
+        T _buffers[3];
+
+        uint8_t _back = 0;
+        uint8_t _middle = 1;
+        uint8_t _front = 2;
+};
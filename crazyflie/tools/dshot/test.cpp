@@ -0,0 +1,142 @@
+/**
+ * Checks the frames Dshot::frame() builds against the DShot layout, the
+ * throttle Dshot::ratioToThrottle() maps a motor ratio to, and the DMA
+ * buffer Dshot::expand() builds from a frame: one compare value per bit,
+ * MSB first, then a single trailing zero
+ *
+ * Copyright (C) 2024 Simon D. Levy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+#include <dshot.hpp>
+
+// As the motor driver computes them for DShot600 on its 84 MHz timer
+static const uint32_t ONE_VALUE = 104;
+static const uint32_t ZERO_VALUE = 52;
+
+// Fills the buffer and the word past it, to catch writes out of bounds
+static const uint32_t CANARY = 0xDEADBEEF;
+
+static uint32_t failures;
+
+static void check(const bool ok, const uint16_t frame, const char * what)
+{
+    if (!ok) {
+        printf("frame 0x%04X: %s\n", frame, what);
+        failures++;
+    }
+}
+
+static void checkExpand(const uint16_t frame)
+{
+    uint32_t buffer[Dshot::BUFFER_SIZE + 1] = {};
+    for (auto & b : buffer) {
+        b = CANARY;
+    }
+
+    Dshot::expand(frame, ONE_VALUE, ZERO_VALUE, buffer);
+
+    // Rebuild the frame from the compare values, MSB first
+    uint16_t bits = 0;
+    auto isValid = true;
+
+    for (uint8_t k=0; k<Dshot::FRAME_BITS; ++k) {
+        isValid &= buffer[k] == ONE_VALUE || buffer[k] == ZERO_VALUE;
+        bits = (bits << 1) | (buffer[k] == ONE_VALUE);
+    }
+
+    check(isValid, frame, "compare value neither one nor zero");
+    check(bits == frame, frame, "bits out of order");
+    check(buffer[Dshot::FRAME_BITS] == 0, frame, "no trailing zero");
+    check(buffer[Dshot::BUFFER_SIZE] == CANARY, frame, "wrote past buffer");
+}
+
+// Eleven bits of value, the telemetry request, then the XOR of the three
+// nibbles above, each field taken bit by bit
+static void checkFrame(const uint16_t value, const bool telemetry)
+{
+    const auto frame = Dshot::frame(value, telemetry);
+
+    uint16_t expected = 0;
+
+    for (int8_t k=10; k>=0; --k) {
+        expected = (expected << 1) | ((value >> k) & 1);
+    }
+
+    expected = (expected << 1) | telemetry;
+
+    uint8_t checksum = 0;
+    for (uint8_t nibble=0; nibble<3; ++nibble) {
+        checksum ^= (expected >> (4 * nibble)) & 0x0F;
+    }
+
+    expected = (expected << 4) | checksum;
+
+    check((frame >> 5) == value, frame, "value bits misplaced");
+    check(((frame >> 4) & 1) == telemetry, frame, "telemetry bit misplaced");
+    check(frame == expected, frame, "bad checksum");
+}
+
+static void checkThrottle(const uint16_t ratio, const uint16_t expected)
+{
+    const auto throttle = Dshot::ratioToThrottle(ratio);
+
+    if (throttle != expected) {
+        printf("ratio %u: throttle %u, expected %u\n",
+                ratio, throttle, expected);
+        failures++;
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    // Stop, the throttle range and its ends, and a telemetry request
+    checkExpand(Dshot::frame(0));
+    checkExpand(Dshot::frame(Dshot::MIN_THROTTLE));
+    checkExpand(Dshot::frame(1046));
+    checkExpand(Dshot::frame(Dshot::MAX_THROTTLE));
+    checkExpand(Dshot::frame(Dshot::MIN_THROTTLE, true));
+
+    // All-zero and all-one frames, and alternating bits
+    checkExpand(0x0000);
+    checkExpand(0xFFFF);
+    checkExpand(0xAAAA);
+    checkExpand(0x5555);
+
+    // Every throttle value, with and without telemetry
+    for (uint16_t value=0; value<=Dshot::MAX_THROTTLE; ++value) {
+        checkFrame(value, false);
+        checkFrame(value, true);
+        checkExpand(Dshot::frame(value));
+    }
+
+    // Values below 48 are commands, so ratios that would map to them stop
+    // the motor instead; throttle starts at the next ratio
+    checkThrottle(0, 0);
+    checkThrottle((47 << 5), 0);
+    checkThrottle((47 << 5) + 31, 0);
+    checkThrottle((48 << 5), Dshot::MIN_THROTTLE);
+    checkThrottle((48 << 5) + 31, Dshot::MIN_THROTTLE);
+    checkThrottle((49 << 5), Dshot::MIN_THROTTLE + 1);
+    checkThrottle(UINT16_MAX, Dshot::MAX_THROTTLE);
+
+    printf("%s: %u failures\n", failures ? "FAILED" : "passed", failures);
+
+    return failures ? 1 : 0;
+}
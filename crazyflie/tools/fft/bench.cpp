@@ -0,0 +1,316 @@
+/**
+ * Checks the FFT against a direct DFT on the host, runs the dynamic notch
+ * on a synthesized gyro signal, and reports the time each takes.  Fails if
+ * a notch engages on an axis with only noise, misses a tone, loses a tone
+ * weaker than the noise, or stays engaged once the tones stop.
+ *
+ * Copyright (C) 2024 Simon D. Levy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <dynamic_notch.hpp>
+
+// As in ImuTask, with the gyro read from its FIFO
+static const float SAMPLE_RATE_HZ = 2000;
+static const float MIN_HZ = 80;
+static const float MAX_HZ = 400;
+static const float Q = 3;
+
+static const uint8_t NOTCHES = DynamicNotch::NOTCHES;
+
+// Motor vibration on each axis, in Hz and deg/sec: two motors apart on x,
+// one on y, none on z
+static const float TONE_HZ[3][NOTCHES] = { {237, 150}, {310, 0}, {0, 0} };
+static const float TONE_AMPLITUDE = 20;
+
+static const float NOISE_AMPLITUDE = 2;
+
+static const uint32_t SECONDS = 60;
+
+// Attenuation each tone needs over the last second
+static const float MIN_ATTENUATION_DB = 15;
+
+// Noise alone on every axis afterwards, for the notches to release
+static const uint32_t RELEASE_SECONDS = 1;
+
+// A tone at half the noise's amplitude, which a notch must still follow to
+// within a bin
+static const float WEAK_TONE_HZ = 237;
+static const float WEAK_TONE_AMPLITUDE = NOISE_AMPLITUDE / 2;
+static const uint32_t WEAK_TONE_SECONDS = 10;
+
+static const uint16_t N = DynamicNotch::FFT_SIZE;
+
+static uint64_t nsec(void)
+{
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static float noise(void)
+{
+    return NOISE_AMPLITUDE * (2.f * rand() / RAND_MAX - 1);
+}
+
+// Largest error of the power spectrum against the direct DFT, relative to
+// the largest power
+static float checkFft(void)
+{
+    RealFft<N> fft;
+    fft.init();
+
+    float in[N];
+    float copy[N];
+
+    for (uint16_t k=0; k<N; ++k) {
+        in[k] = sinf(2 * (float)M_PI * 5 * k / N) + 0.5f * noise();
+        copy[k] = in[k];
+    }
+
+    float power[N/2];
+    fft.powerSpectrum(in, power);
+
+    float maxPower = 0;
+    float maxError = 0;
+
+    for (uint16_t j=0; j<N/2; ++j) {
+
+        double re = 0;
+        double im = 0;
+
+        for (uint16_t k=0; k<N; ++k) {
+            re += copy[k] * cos(2 * M_PI * j * k / N);
+            im -= copy[k] * sin(2 * M_PI * j * k / N);
+        }
+
+        const float expected = re * re + im * im;
+        const float error = fabsf(power[j] - expected);
+
+        maxPower = expected > maxPower ? expected : maxPower;
+        maxError = error > maxError ? error : maxError;
+    }
+
+    return maxError / maxPower;
+}
+
+static float timeFft(void)
+{
+    static const uint32_t CALLS = 100000;
+
+    RealFft<N> fft;
+    fft.init();
+
+    float in[N];
+    float power[N/2];
+    float sum = 0;
+
+    const auto start = nsec();
+
+    for (uint32_t c=0; c<CALLS; ++c) {
+        for (uint16_t k=0; k<N; ++k) {
+            in[k] = (float)(k ^ c);
+        }
+        fft.powerSpectrum(in, power);
+        sum += power[c % (N/2)];
+    }
+
+    const auto elapsed = nsec() - start;
+
+    // Keeps the calls from being optimized away
+    if (sum < 0) {
+        printf("%f\n", (double)sum);
+    }
+
+    return (float)elapsed / CALLS;
+}
+
+// Fraction of the samples after the first second with the x notch engaged,
+// and its final center
+static float trackWeakTone(float & centerHz)
+{
+    static DynamicNotch notch;
+    notch.init(SAMPLE_RATE_HZ, MIN_HZ, MAX_HZ, Q);
+
+    const uint32_t samples = WEAK_TONE_SECONDS * SAMPLE_RATE_HZ;
+
+    uint32_t engaged = 0;
+
+    for (uint32_t n=0; n<samples; ++n) {
+
+        Axis3f gyro = {};
+        gyro.axis[0] = noise() + WEAK_TONE_AMPLITUDE *
+            sinf(2 * (float)M_PI * WEAK_TONE_HZ * n / SAMPLE_RATE_HZ);
+
+        notch.apply(gyro);
+
+        if (n >= SAMPLE_RATE_HZ) {
+            engaged += notch.centerHz[0][0] != 0 || notch.centerHz[0][1] != 0;
+        }
+    }
+
+    centerHz = notch.centerHz[0][0] != 0 ?
+        notch.centerHz[0][0] : notch.centerHz[0][1];
+
+    return (float)engaged / (samples - SAMPLE_RATE_HZ);
+}
+
+int main(int argc, char ** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    srand(0);
+
+    printf("FFT size %u, max relative error vs. DFT %.2e\n",
+            N, (double)checkFft());
+
+    printf("powerSpectrum: %.1f ns/call\n", (double)timeFft());
+
+    static DynamicNotch notch;
+    notch.init(SAMPLE_RATE_HZ, MIN_HZ, MAX_HZ, Q);
+
+    const uint32_t samples = SECONDS * SAMPLE_RATE_HZ;
+
+    // Each tone's phasor in the output over the last second, after the
+    // notches settle
+    double re[3][NOTCHES] = {};
+    double im[3][NOTCHES] = {};
+
+    uint64_t elapsed = 0;
+    uint64_t maxElapsed = 0;
+
+    bool engaged[3] = {};
+
+    for (uint32_t n=0; n<samples; ++n) {
+
+        const float t = n / SAMPLE_RATE_HZ;
+
+        Axis3f gyro = {};
+
+        for (uint8_t i=0; i<3; ++i) {
+            gyro.axis[i] = noise();
+            for (uint8_t j=0; j<NOTCHES; ++j) {
+                gyro.axis[i] +=
+                    TONE_AMPLITUDE * sinf(2 * (float)M_PI * TONE_HZ[i][j] * t);
+            }
+        }
+
+        const auto start = nsec();
+        notch.apply(gyro);
+        const auto sampleNsec = nsec() - start;
+
+        elapsed += sampleNsec;
+        maxElapsed = sampleNsec > maxElapsed ? sampleNsec : maxElapsed;
+
+        for (uint8_t i=0; i<3; ++i) {
+            for (uint8_t j=0; j<NOTCHES; ++j) {
+                engaged[i] |= notch.centerHz[i][j] != 0;
+            }
+        }
+
+        if (n >= samples - SAMPLE_RATE_HZ) {
+            for (uint8_t i=0; i<3; ++i) {
+                for (uint8_t j=0; j<NOTCHES; ++j) {
+                    const auto phase = 2 * M_PI * TONE_HZ[i][j] * t;
+                    re[i][j] += gyro.axis[i] * cos(phase);
+                    im[i][j] += gyro.axis[i] * sin(phase);
+                }
+            }
+        }
+    }
+
+    uint32_t failures = 0;
+
+    for (uint8_t i=0; i<3; ++i) {
+
+        printf("axis %c: notches", 'x' + i);
+        for (uint8_t j=0; j<NOTCHES; ++j) {
+            printf(" %5.1f", (double)notch.centerHz[i][j]);
+        }
+        printf(" Hz\n");
+
+        for (uint8_t j=0; j<NOTCHES; ++j) {
+
+            if (TONE_HZ[i][j] == 0) {
+                continue;
+            }
+
+            // Amplitude of the output at the tone, against the input's
+            const auto amplitude =
+                2 * sqrt(re[i][j] * re[i][j] + im[i][j] * im[i][j]) /
+                SAMPLE_RATE_HZ;
+            const auto db = 20 * log10(amplitude / TONE_AMPLITUDE);
+
+            printf("  tone %5.1f Hz: %5.1f dB", (double)TONE_HZ[i][j], db);
+
+            if (db > -MIN_ATTENUATION_DB) {
+                printf(" (FAILED: tone not notched)");
+                failures++;
+            }
+
+            printf("\n");
+        }
+
+        if (TONE_HZ[i][0] == 0 && engaged[i]) {
+            printf("  FAILED: engaged on noise\n");
+            failures++;
+        }
+    }
+
+    for (uint32_t n=0; n<RELEASE_SECONDS * SAMPLE_RATE_HZ; ++n) {
+        Axis3f gyro = {};
+        for (uint8_t i=0; i<3; ++i) {
+            gyro.axis[i] = noise();
+        }
+        notch.apply(gyro);
+    }
+
+    for (uint8_t i=0; i<3; ++i) {
+        for (uint8_t j=0; j<NOTCHES; ++j) {
+            if (notch.centerHz[i][j] != 0) {
+                printf("axis %c: FAILED: notch still at %5.1f Hz %u sec "
+                        "after the tones stopped\n", 'x' + i,
+                        (double)notch.centerHz[i][j], RELEASE_SECONDS);
+                failures++;
+            }
+        }
+    }
+
+    float weakHz = 0;
+    const auto weakEngaged = trackWeakTone(weakHz);
+
+    printf("weak tone %5.1f Hz at %.1f deg/sec: notch %5.1f Hz, "
+            "engaged %.0f%% of the time", (double)WEAK_TONE_HZ,
+            (double)WEAK_TONE_AMPLITUDE, (double)weakHz,
+            100 * (double)weakEngaged);
+
+    if (weakEngaged < 0.9f ||
+            fabsf(weakHz - WEAK_TONE_HZ) > SAMPLE_RATE_HZ / N) {
+        printf(" (FAILED: tone lost)");
+        failures++;
+    }
+
+    printf("\n");
+
+    printf("apply: %.1f ns/sample, %lu ns max\n",
+            (double)elapsed / samples, (unsigned long)maxElapsed);
+
+    return failures ? 1 : 0;
+}
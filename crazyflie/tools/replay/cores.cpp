@@ -0,0 +1,177 @@
+/**
+ * Instantiates the packed EKF core at several sizes side by side, checks
+ * each one's joint update against the same measurements fused one at a
+ * time, and reports the time its predict and update calls take
+ *
+ * Copyright (C) 2024 Simon D. Levy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <ekf_packed.hpp>
+
+static const uint32_t CALLS = 100000;
+
+// Float rounding differs between the joint and sequential updates
+static const float TOLERANCE = 1e-4;
+
+static uint64_t nsec(void)
+{
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static float uniform(void)
+{
+    return 2.f * rand() / RAND_MAX - 1;
+}
+
+template <uint8_t N, uint8_t M>
+static void randomize(PackedEkf<N, M> & ekf)
+{
+    float pdiag[N] = {};
+    for (uint8_t i=0; i<N; ++i) {
+        pdiag[i] = 1 + uniform() / 2;
+    }
+
+    ekf.initialize(pdiag);
+
+    // Correlate the states a little, keeping P positive-definite
+    float F[N*N] = {};
+    for (uint8_t i=0; i<N; ++i) {
+        for (uint8_t j=0; j<N; ++j) {
+            F[i*N+j] = (i == j) + 0.1f * uniform();
+        }
+    }
+
+    ekf.multiply_covariance(F);
+}
+
+// Largest difference between the joint update and M sequential scalar
+// updates of the same prior, relative to the largest entry of P
+template <uint8_t N, uint8_t M>
+static float checkUpdate(void)
+{
+    PackedEkf<N, M> joint;
+    randomize(joint);
+
+    PackedEkf<N, M> sequential = joint;
+
+    float z[M] = {};
+    float hx[M] = {};
+    float H[M][N] = {};
+
+    for (uint8_t k=0; k<M; ++k) {
+        z[k] = uniform();
+        for (uint8_t j=0; j<N; ++j) {
+            H[k][j] = uniform();
+        }
+    }
+
+    const float r = 0.1f;
+
+    joint.template update<M>(z, hx, H, r);
+
+    // The measurements are linear in the state (which starts at zero), so
+    // fusing them one at a time, each predicted from the state so far, is
+    // equivalent to fusing them jointly
+    for (uint8_t k=0; k<M; ++k) {
+        float predicted = 0;
+        for (uint8_t j=0; j<N; ++j) {
+            predicted += H[k][j] * sequential.x[j];
+        }
+        sequential.scalar_update(z[k], predicted, H[k], r);
+    }
+
+    float maxP = 0;
+    float maxError = 0;
+
+    for (uint8_t i=0; i<PackedEkf<N, M>::NP; ++i) {
+        const auto error = fabsf(joint.P[i] - sequential.P[i]);
+        maxP = fabsf(joint.P[i]) > maxP ? fabsf(joint.P[i]) : maxP;
+        maxError = error > maxError ? error : maxError;
+    }
+
+    return maxError / maxP;
+}
+
+template <uint8_t N, uint8_t M>
+static bool run(void)
+{
+    PackedEkf<N, M> ekf;
+    randomize(ekf);
+
+    float F[N*N] = {};
+    for (uint8_t i=0; i<N; ++i) {
+        F[i*N+i] = 1;
+        if (i + 1 < N) {
+            F[i*N+i+1] = 0.01f;
+        }
+    }
+
+    float fx[N] = {};
+
+    auto start = nsec();
+
+    for (uint32_t c=0; c<CALLS; ++c) {
+        ekf.predict(fx, F);
+        ekf.cleanup_covariance(1e-6, 100);
+    }
+
+    const auto predictNsec = nsec() - start;
+
+    float z[M] = {};
+    float hx[M] = {};
+    float H[M][N] = {};
+    for (uint8_t k=0; k<M; ++k) {
+        H[k][k] = 1;
+    }
+
+    start = nsec();
+
+    for (uint32_t c=0; c<CALLS; ++c) {
+        z[c % M] = uniform();
+        ekf.template update<M>(z, hx, H, 0.1f);
+        ekf.cleanup_covariance(1e-6, 100);
+    }
+
+    const auto updateNsec = nsec() - start;
+
+    const auto error = checkUpdate<N, M>();
+
+    printf("PackedEkf<%u,%u>: predict %6.1f ns/call, update %6.1f ns/call, "
+            "joint vs. sequential %.2e\n",
+            N, M, (double)predictNsec / CALLS, (double)updateNsec / CALLS,
+            (double)error);
+
+    return error <= TOLERANCE;
+}
+
+int main(int argc, char ** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    srand(0);
+
+    // Range and flow; with position; attitude only
+    const auto ok = run<7, 3>() & run<9, 3>() & run<3, 1>();
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,55 @@
+/**
+ * Binary measurement log for replaying the EKF off-target
+ *
+ * Copyright (C) 2024 Simon D. Levy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <datatypes.h>
+
+/**
+ * A log is an ekflog_header_t followed by fixed-size records in the order
+ * the estimator task received them, so that it can be memory-mapped and
+ * walked in place.  The data fields are:
+ *
+ *   MeasurementTypeGyroscope     x, y, z in deg/sec
+ *   MeasurementTypeAcceleration  x, y, z in gs
+ *   MeasurementTypeRange         distance in mm
+ *   MeasurementTypeFlow          dpixelx, dpixely, dt (sec)
+ */
+
+static const char EKFLOG_MAGIC[8] = { 'E', 'K', 'F', 'L', 'O', 'G', '0', '1' };
+
+typedef struct {
+
+    char magic[8];
+
+    uint32_t recordSize;
+    uint32_t count;
+
+} ekflog_header_t;
+
+typedef struct {
+
+    uint64_t timestamp; // usec, when the sensor sampled the data
+
+    uint32_t type;      // MeasurementType
+
+    float data[3];
+
+} ekflog_record_t;
@@ -0,0 +1,583 @@
+/**
+ * Replays a recorded measurement log through the EKF on the host, reporting
+ * the state trajectory and the time spent in each estimator call
+ *
+ * Copyright (C) 2024 Simon D. Levy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ekf.hpp>
+#include <imu_preintegrator.hpp>
+
+#include "ekflog.h"
+
+int consolePrintf(const char * fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    const auto n = vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+// As in EstimatorTask
+static const uint32_t TICK_USEC = 1000;
+static const uint32_t PREDICTION_INTERVAL_USEC = 10000;
+
+// As in ImuTask, for a 1 kHz IMU
+static const uint32_t SAMPLES_PER_DELTA = PREDICTION_INTERVAL_USEC / 1000;
+
+typedef struct {
+
+    const char * name;
+    uint64_t count;
+    uint64_t totalNsec;
+    uint64_t maxNsec;
+
+} timing_t;
+
+static uint64_t nsec(void)
+{
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void record(timing_t & timing, const uint64_t start)
+{
+    const auto elapsed = nsec() - start;
+
+    timing.count++;
+    timing.totalNsec += elapsed;
+    timing.maxNsec = elapsed > timing.maxNsec ? elapsed : timing.maxNsec;
+}
+
+static void report(const timing_t & timing)
+{
+    fprintf(stderr, "%-10s %10lu calls %10.1f ns/call %10lu ns max\n",
+            timing.name,
+            (unsigned long)timing.count,
+            timing.count ? (double)timing.totalNsec / timing.count : 0.0,
+            (unsigned long)timing.maxNsec);
+}
+
+static const ekflog_record_t * mapLog(const char * filename, uint32_t & count)
+{
+    const auto fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+        perror(filename);
+        return NULL;
+    }
+
+    struct stat st = {};
+    fstat(fd, &st);
+
+    if ((size_t)st.st_size < sizeof(ekflog_header_t)) {
+        fprintf(stderr, "%s: too short for an EKF log\n", filename);
+        close(fd);
+        return NULL;
+    }
+
+    const auto base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+
+    const auto header = (const ekflog_header_t *)base;
+
+    const auto expectedSize =
+        sizeof(ekflog_header_t) + (size_t)header->count * sizeof(ekflog_record_t);
+
+    if (memcmp(header->magic, EKFLOG_MAGIC, sizeof(EKFLOG_MAGIC)) != 0 ||
+            header->recordSize != sizeof(ekflog_record_t) ||
+            (size_t)st.st_size < expectedSize) {
+        fprintf(stderr, "%s: not a valid EKF log\n", filename);
+        return NULL;
+    }
+
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    count = header->count;
+
+    return (const ekflog_record_t *)(header + 1);
+}
+
+// The packed core, with no sparse kernels in BasicEKF for it, so that the
+// covariance goes through the dense PackedEkf::predict() instead
+template <uint8_t N, uint8_t M>
+class DensePackedEkf : public PackedEkf<N, M> {
+};
+
+typedef BasicEKF<DensePackedEkf> DenseEKF;
+
+// Runs the filter and the dense reference side by side on the same inputs,
+// comparing their covariances after every call that changes them
+class LockstepEKF {
+
+    public:
+
+        static const uint8_t N = EKF::N;
+
+        // Largest difference seen, relative to the largest entry of P
+        static double maxError;
+        static uint32_t checks;
+
+        void initialize(const bool imuRateMean=false)
+        {
+            _sparse.initialize(imuRateMean);
+            _dense.initialize(imuRateMean);
+        }
+
+        void accumulate_gyro(const uint64_t timestampUsec, const axis3_t & gyro)
+        {
+            _sparse.accumulate_gyro(timestampUsec, gyro);
+            _dense.accumulate_gyro(timestampUsec, gyro);
+        }
+
+        void accumulate_accel(const uint64_t timestampUsec, const axis3_t & accel)
+        {
+            _sparse.accumulate_accel(timestampUsec, accel);
+            _dense.accumulate_accel(timestampUsec, accel);
+        }
+
+        void accumulate_delta(const imuDelta_t & delta)
+        {
+            _sparse.accumulate_delta(delta);
+            _dense.accumulate_delta(delta);
+        }
+
+        void predict(void)
+        {
+            _sparse.predict();
+            _dense.predict();
+            compare();
+        }
+
+        void update_with_range(const float distance, const uint64_t timestampUsec)
+        {
+            _sparse.update_with_range(distance, timestampUsec);
+            _dense.update_with_range(distance, timestampUsec);
+            compare();
+        }
+
+        void update_with_flow(
+                const float dt,
+                const float dpixelx,
+                const float dpixely,
+                const uint64_t timestampUsec)
+        {
+            _sparse.update_with_flow(dt, dpixelx, dpixely, timestampUsec);
+            _dense.update_with_flow(dt, dpixelx, dpixely, timestampUsec);
+            compare();
+        }
+
+        bool finalize(void)
+        {
+            const auto inBounds = _sparse.finalize();
+            _dense.finalize();
+            compare();
+            return inBounds;
+        }
+
+        void get_vehicle_state(vehicleState_t & state)
+        {
+            _sparse.get_vehicle_state(state);
+        }
+
+        float get_covariance(const uint8_t i, const uint8_t j) const
+        {
+            return _sparse.get_covariance(i, j);
+        }
+
+    private:
+
+        EKF _sparse;
+        DenseEKF _dense;
+
+        void compare(void)
+        {
+            double maxP = 0;
+            double maxDiff = 0;
+
+            for (uint8_t i=0; i<N; ++i) {
+                for (uint8_t j=0; j<N; ++j) {
+                    const double p = _dense.get_covariance(i, j);
+                    const double diff = fabs(_sparse.get_covariance(i, j) - p);
+                    maxP = fabs(p) > maxP ? fabs(p) : maxP;
+                    maxDiff = diff > maxDiff ? diff : maxDiff;
+                }
+            }
+
+            const auto error = maxP > 0 ? maxDiff / maxP : maxDiff;
+
+            maxError = error > maxError ? error : maxError;
+            checks++;
+        }
+};
+
+double LockstepEKF::maxError;
+uint32_t LockstepEKF::checks;
+
+// Float rounding differs between the two, and the states they feed back
+// into drift apart with it
+static const double DENSE_TOLERANCE = 1e-4;
+
+static void usage(const char * progname)
+{
+    fprintf(stderr, "Usage: %s [-q] [-m] [-p] [-u] [-d] LOGFILE\n", progname);
+    fprintf(stderr, "  -q  don't print the state trajectory\n");
+    fprintf(stderr, "  -m  propagate the state mean at the IMU rate\n");
+    fprintf(stderr, "  -p  pre-integrate the IMU samples over each prediction\n");
+    fprintf(stderr, "  -u  use the UD-factorized filter\n");
+    fprintf(stderr, "  -d  check the sparse covariance propagation against "
+            "the dense one\n");
+    exit(1);
+}
+
+// Numerical health of the covariance, checked after every prediction
+typedef struct {
+
+    uint32_t checks;
+    uint32_t indefinite; // steps with a negative eigenvalue
+    uint32_t atBounds;   // steps with P at the packed filter's clamp values
+    double minEigenvalue; // relative to the largest one
+
+} health_t;
+
+// Smallest and largest eigenvalues of a symmetric matrix, by cyclic Jacobi
+// rotations
+template <uint8_t N>
+static void eigenvalueRange(double A[N][N], double & lo, double & hi)
+{
+    for (uint8_t sweep=0; sweep<50; ++sweep) {
+
+        double off = 0;
+        for (uint8_t p=0; p<N; ++p) {
+            for (uint8_t q=p+1; q<N; ++q) {
+                off += A[p][q] * A[p][q];
+            }
+        }
+
+        if (off < 1e-30) {
+            break;
+        }
+
+        for (uint8_t p=0; p<N; ++p) {
+            for (uint8_t q=p+1; q<N; ++q) {
+
+                if (A[p][q] == 0) {
+                    continue;
+                }
+
+                const auto theta = (A[q][q] - A[p][p]) / (2 * A[p][q]);
+                const auto t = (theta >= 0 ? 1 : -1) /
+                    (fabs(theta) + sqrt(theta * theta + 1));
+                const auto c = 1 / sqrt(t * t + 1);
+                const auto s = t * c;
+
+                for (uint8_t k=0; k<N; ++k) {
+                    const auto akp = A[k][p];
+                    const auto akq = A[k][q];
+                    A[k][p] = c * akp - s * akq;
+                    A[k][q] = s * akp + c * akq;
+                }
+
+                for (uint8_t k=0; k<N; ++k) {
+                    const auto apk = A[p][k];
+                    const auto aqk = A[q][k];
+                    A[p][k] = c * apk - s * aqk;
+                    A[q][k] = s * apk + c * aqk;
+                }
+            }
+        }
+    }
+
+    lo = hi = A[0][0];
+    for (uint8_t k=1; k<N; ++k) {
+        lo = A[k][k] < lo ? A[k][k] : lo;
+        hi = A[k][k] > hi ? A[k][k] : hi;
+    }
+}
+
+template <class Filter>
+static void checkHealth(const Filter & ekf, health_t & health)
+{
+    static const uint8_t N = Filter::N;
+
+    double P[N][N] = {};
+
+    auto isAtBounds = false;
+
+    for (uint8_t i=0; i<N; ++i) {
+        for (uint8_t j=0; j<N; ++j) {
+            P[i][j] = ekf.get_covariance(i, j);
+            isAtBounds |= P[i][j] >= 100 || (i == j && P[i][j] <= 1e-6);
+        }
+    }
+
+    double lo = 0;
+    double hi = 0;
+    eigenvalueRange<N>(P, lo, hi);
+
+    // Allow for float rounding of the largest eigenvalue
+    const auto relative = hi > 0 ? lo / hi : 0;
+
+    health.checks++;
+    health.indefinite += relative < -1e-6;
+    health.atBounds += isAtBounds;
+    health.minEigenvalue =
+        relative < health.minEigenvalue ? relative : health.minEigenvalue;
+}
+
+template <class Filter>
+static void replay(
+        const ekflog_record_t * records,
+        const uint32_t count,
+        const bool quiet,
+        const bool imuRateMean,
+        const bool preintegrate)
+{
+    timing_t imuTiming = { "imu", 0, 0, 0 };
+    timing_t predictTiming = { "predict", 0, 0, 0 };
+    timing_t rangeTiming = { "range", 0, 0, 0 };
+    timing_t flowTiming = { "flow", 0, 0, 0 };
+    timing_t finalizeTiming = { "finalize", 0, 0, 0 };
+    timing_t stateTiming = { "state", 0, 0, 0 };
+
+    health_t health = {};
+    health.minEigenvalue = 1;
+
+    static Filter ekf;
+    ekf.initialize(imuRateMean);
+
+    if (!quiet) {
+        printf("time,z,dx,dy,dz,phi,theta,psi\n");
+    }
+
+    // Run the estimator task's loop on a 1 msec tick of sensor time: predict
+    // when due, consume the measurements that arrived during the tick, then
+    // finalize and publish
+    const auto startUsec = records[0].timestamp;
+    auto nextPredictionUsec = startUsec;
+
+    uint32_t resets = 0;
+    uint32_t k = 0;
+
+    // Pre-integration pairs each accel sample with the gyro one before it,
+    // and predicts when a delta is complete rather than on the tick
+    ImuPreintegrator preintegrator = {};
+    preintegrator.reset(startUsec);
+    Axis3f lastGyro = {};
+
+    for (auto tickUsec = startUsec; k < count; tickUsec += TICK_USEC) {
+
+        auto didPredict = false;
+
+        if (!preintegrate && tickUsec >= nextPredictionUsec) {
+            const auto start = nsec();
+            ekf.predict();
+            record(predictTiming, start);
+            nextPredictionUsec = tickUsec + PREDICTION_INTERVAL_USEC;
+            didPredict = true;
+            checkHealth(ekf, health);
+        }
+        for (; k < count && records[k].timestamp < tickUsec + TICK_USEC; ++k) {
+
+            const auto & r = records[k];
+
+            switch (r.type) {
+
+                case MeasurementTypeGyroscope: {
+                    if (preintegrate) {
+                        memcpy(&lastGyro, r.data, sizeof(lastGyro));
+                        break;
+                    }
+                    const axis3_t gyro = { r.data[0], r.data[1], r.data[2] };
+                    const auto start = nsec();
+                    ekf.accumulate_gyro(r.timestamp, gyro);
+                    record(imuTiming, start);
+                } break;
+
+                case MeasurementTypeAcceleration: {
+                    if (preintegrate) {
+                        Axis3f accel = {};
+                        memcpy(&accel, r.data, sizeof(accel));
+                        auto start = nsec();
+                        preintegrator.integrate(lastGyro, accel, r.timestamp);
+                        record(imuTiming, start);
+                        if (preintegrator.count() == SAMPLES_PER_DELTA) {
+                            imuDelta_t delta = {};
+                            preintegrator.take(delta);
+                            start = nsec();
+                            ekf.accumulate_delta(delta);
+                            ekf.predict();
+                            record(predictTiming, start);
+                            didPredict = true;
+                            checkHealth(ekf, health);
+                        }
+                        break;
+                    }
+                    const axis3_t accel = { r.data[0], r.data[1], r.data[2] };
+                    const auto start = nsec();
+                    ekf.accumulate_accel(r.timestamp, accel);
+                    record(imuTiming, start);
+                } break;
+
+                case MeasurementTypeRange: {
+                    const auto start = nsec();
+                    ekf.update_with_range(r.data[0], r.timestamp);
+                    record(rangeTiming, start);
+                } break;
+
+                case MeasurementTypeFlow: {
+                    const auto start = nsec();
+                    ekf.update_with_flow(
+                            r.data[2], r.data[0], r.data[1], r.timestamp);
+                    record(flowTiming, start);
+                } break;
+
+                default:
+                    break;
+            }
+        }
+
+        auto start = nsec();
+        const auto inBounds = ekf.finalize();
+        record(finalizeTiming, start);
+
+        if (!inBounds) {
+            ekf.initialize(imuRateMean);
+            resets++;
+        }
+
+        vehicleState_t state = {};
+        start = nsec();
+        ekf.get_vehicle_state(state);
+        record(stateTiming, start);
+
+        if (!quiet && didPredict) {
+            printf("%.3f,%+.4f,%+.4f,%+.4f,%+.4f,%+.3f,%+.3f,%+.3f\n",
+                    (tickUsec - startUsec) / 1e6,
+                    (double)state.z, (double)state.dx, (double)state.dy,
+                    (double)state.dz, (double)state.phi, (double)state.theta,
+                    (double)state.psi);
+        }
+    }
+
+    fprintf(stderr, "%u records, %.1f sec of sensor time, %u resets\n",
+            count, (records[count-1].timestamp - startUsec) / 1e6, resets);
+
+    report(imuTiming);
+    report(predictTiming);
+    report(rangeTiming);
+    report(flowTiming);
+    report(finalizeTiming);
+    report(stateTiming);
+
+    fprintf(stderr, "covariance: min relative eigenvalue %+.3e, "
+            "indefinite %u/%u, at clamp bounds %u/%u\n",
+            health.minEigenvalue, health.indefinite, health.checks,
+            health.atBounds, health.checks);
+}
+
+int main(int argc, char ** argv)
+{
+    auto quiet = false;
+    auto imuRateMean = false;
+    auto preintegrate = false;
+    auto ud = false;
+    auto dense = false;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "qmpud")) != -1) {
+        if (opt == 'q') {
+            quiet = true;
+        }
+        else if (opt == 'm') {
+            imuRateMean = true;
+        }
+        else if (opt == 'p') {
+            preintegrate = true;
+        }
+        else if (opt == 'u') {
+            ud = true;
+        }
+        else if (opt == 'd') {
+            dense = true;
+        }
+        else {
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+
+    uint32_t count = 0;
+    const auto records = mapLog(argv[optind], count);
+
+    if (!records) {
+        return 1;
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+
+    if (imuRateMean && preintegrate) {
+        fprintf(stderr, "-m and -p can't be used together\n");
+        return 1;
+    }
+
+    if (ud && dense) {
+        fprintf(stderr, "-u and -d can't be used together\n");
+        return 1;
+    }
+
+    if (dense) {
+
+        replay<LockstepEKF>(records, count, quiet, imuRateMean, preintegrate);
+
+        fprintf(stderr, "dense check: max relative error %.3e over %u steps\n",
+                LockstepEKF::maxError, LockstepEKF::checks);
+
+        return LockstepEKF::maxError > DENSE_TOLERANCE;
+    }
+
+    if (ud) {
+        replay<UdEKF>(records, count, quiet, imuRateMean, preintegrate);
+    }
+    else {
+        replay<EKF>(records, count, quiet, imuRateMean, preintegrate);
+    }
+
+    return 0;
+}
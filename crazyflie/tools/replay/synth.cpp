@@ -0,0 +1,120 @@
+/**
+ * Writes a synthetic hover log for the EKF replay driver, for benchmarking
+ * when no recorded flight data is at hand
+ *
+ * Copyright (C) 2024 Simon D. Levy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ekflog.h"
+
+// Sensor rates and delays as on the Crazyflie with a Flowdeck
+static const uint32_t IMU_PERIOD_USEC = 1000;
+static const uint32_t FLOW_PERIOD_USEC = 10000;
+static const uint32_t FLOW_DELAY_USEC = FLOW_PERIOD_USEC / 2;
+static const uint32_t RANGE_PERIOD_USEC = 25000;
+static const uint32_t RANGE_DELAY_USEC = RANGE_PERIOD_USEC / 2;
+
+static const float HOVER_ALTITUDE_M = 0.5;
+
+static float noise(const float stdev)
+{
+    // Sum of uniforms: cheap and close enough to Gaussian
+    float s = 0;
+    for (uint8_t k=0; k<4; ++k) {
+        s += (float)rand() / RAND_MAX - 0.5f;
+    }
+    return s * stdev * 1.732f;
+}
+
+static void put(
+        FILE * fp,
+        uint32_t & count,
+        const uint64_t timestamp,
+        const MeasurementType type,
+        const float d0,
+        const float d1 = 0,
+        const float d2 = 0)
+{
+    const ekflog_record_t r = { timestamp, (uint32_t)type, { d0, d1, d2 } };
+    fwrite(&r, sizeof(r), 1, fp);
+    count++;
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s SECONDS LOGFILE\n", argv[0]);
+        return 1;
+    }
+
+    const auto durationUsec = (uint64_t)(atof(argv[1]) * 1e6);
+
+    const auto fp = fopen(argv[2], "wb");
+
+    if (!fp) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    ekflog_header_t header = {};
+    memcpy(header.magic, EKFLOG_MAGIC, sizeof(EKFLOG_MAGIC));
+    header.recordSize = sizeof(ekflog_record_t);
+    fwrite(&header, sizeof(header), 1, fp);
+
+    srand(0);
+
+    uint32_t count = 0;
+
+    for (uint64_t t=IMU_PERIOD_USEC; t<=durationUsec; t+=IMU_PERIOD_USEC) {
+
+        // Gentle roll/pitch rocking about a hover
+        const auto s = t / 1e6f;
+        const auto roll = 10 * sinf(2 * (float)M_PI * 0.5f * s);
+        const auto pitch = 10 * sinf(2 * (float)M_PI * 0.3f * s);
+
+        put(fp, count, t, MeasurementTypeGyroscope,
+                roll + noise(0.5), -pitch + noise(0.5), noise(0.5));
+
+        put(fp, count, t, MeasurementTypeAcceleration,
+                noise(0.02), noise(0.02), 1 + noise(0.02));
+
+        // The flow deck stamps each reading at the middle of the interval
+        // it integrates over
+        if (t % FLOW_PERIOD_USEC == 0) {
+            put(fp, count, t - FLOW_DELAY_USEC, MeasurementTypeFlow,
+                    noise(2), noise(2), FLOW_PERIOD_USEC / 1e6f);
+        }
+
+        // The ranger delivers each reading half a timing budget late
+        if (t % RANGE_PERIOD_USEC == 0) {
+            put(fp, count, t - RANGE_DELAY_USEC, MeasurementTypeRange,
+                    1000 * HOVER_ALTITUDE_M + noise(5));
+        }
+    }
+
+    header.count = count;
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, fp);
+    fclose(fp);
+
+    fprintf(stderr, "%u records\n", count);
+
+    return 0;
+}